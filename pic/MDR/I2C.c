@@ -1,6 +1,5 @@
-#define __16f1847
-#include <pic16f1847.h>
 #include <stdint.h>
+#include "hal.h"
 #include "I2C.h"
 
 /* set clock high (default state) */
@@ -11,13 +10,30 @@
 #define release_SDA() LATB |= SDA
 /* set data low */
 #define hold_SDA() LATB &= ~SDA
-/* a small delay for better clock */
+/* delay to respect the half clock period (I2C_KHZ)
+ * setting a pin already takes one instruction cycle (1us at 4MHz), and there is at least one more instruction between two clock edges
+ * thus no delay is required up to 400kHz (the fastest 24LC256 mode), and only a few NOPs for slower clocks
+ */
+#define HALF_CYCLES (FOSC/4/2/1000/I2C_KHZ) /* instruction cycles per half clock period */
+#if HALF_CYCLES<=2
+#define delay()
+#elif HALF_CYCLES<=3
+#define delay() __asm\
+	nop\
+__endasm
+#elif HALF_CYCLES<=4
+#define delay() __asm\
+	nop\
+	nop\
+__endasm
+#else
 #define delay() __asm\
 	nop\
 	nop\
 	nop\
 	nop\
 __endasm
+#endif
 
 /* read SDA
  * set SDA as input in the begining
@@ -75,7 +91,6 @@ uint8_t send_byte(uint8_t byte)
 	/* send every bit, MSb first */
 	for (bit = 0; bit < 8; bit++) {
 		hold_SCL(); /* value can change when SCL is low */
-		delay();
 		if (byte&0x80) {
 			release_SDA(); /* set high for 1 */
 		} else {
@@ -84,14 +99,12 @@ uint8_t send_byte(uint8_t byte)
 		delay();
 		release_SCL(); /* set clock high to indicate valid value */
 		byte <<= 1;
+		delay();
 	}
 	/* read ack */
-	delay();
 	hold_SCL(); /* set clock to low for SDA to change */
 	TRISB |= SDA; /* set as input */
 	delay(); /* wait for SDA to change */
-	delay();
-	delay();
 	release_SCL(); /* SDA should be valid when clock is high */
 	delay();
 	/* we don't verify the SCL state as only we can drive it */
@@ -101,7 +114,6 @@ uint8_t send_byte(uint8_t byte)
 		ack = 0;
 	}
 	hold_SCL(); /* put clock to low, as safe state */
-	delay();
 	release_SDA(); /* set output to high (default) */
 	TRISB &= ~SDA; /* set back to output */
 	return ack;
@@ -121,10 +133,9 @@ uint8_t read_byte(uint8_t ack)
 		delay(); /* wait for SDA to change */
 		release_SCL(); /* SDA should be valid when clock is high */
 		byte <<= 1; /* make place to save the next bit */
+		delay();
 		if (PORTB&SDA) { /* read bit */
-			byte += 1;
-		} else {
-			byte += 0;
+			byte |= 1;
 		}
 		hold_SCL(); /* set clock to low for SDA to change */
 	}
@@ -140,3 +151,35 @@ uint8_t read_byte(uint8_t ack)
 	hold_SCL(); /* set clock to low for SDA to change */
 	return byte;
 }
+
+/* read several bytes in a row (sequential read)
+ * an ack is sent after every byte, except after the last one if nack is set (to end the read)
+ */
+void read_bytes(uint8_t* bytes, uint8_t length, uint8_t nack)
+{
+	while (length>1) {
+		*bytes++ = read_byte(1);
+		length--;
+	}
+	if (length) {
+		*bytes = read_byte(!nack);
+	}
+}
+
+/* poll the device until it acknowledges its address
+ * an EEPROM does not acknowledge while it is writing
+ * return 0 once acknowledged, 1 if the device did not answer in time
+ */
+uint8_t poll_ack(uint8_t address)
+{
+	uint8_t retry;
+	for (retry=0; retry<0xff; retry++) {
+		send_start();
+		if (!send_byte(address)) { /* device acknowledged */
+			send_stop();
+			return 0;
+		}
+	}
+	send_stop();
+	return 1;
+}
@@ -1,11 +1,17 @@
-#define __16f1847
-#include <pic16f1847.h>
 #include <stdint.h>
+#include "hal.h"
  
 #define SCL _RB6 /* pin 12, external 24LC256 I2C EEPROM memory */
 #define SDA _RB7 /* pin 13, external 24LC256 I2C EEPROM memory */
 
+#define FOSC 4000000 /* external 4MHz ceramic resonator */
+#ifndef I2C_KHZ
+#define I2C_KHZ 400 /* I2C clock frequency, in kHz (the 24LC256 supports up to 400kHz at 5V) */
+#endif
+
 void send_start(void);
 void send_stop(void);
 uint8_t send_byte(uint8_t byte);
 uint8_t read_byte(uint8_t ack);
+void read_bytes(uint8_t* bytes, uint8_t length, uint8_t nack);
+uint8_t poll_ack(uint8_t address);
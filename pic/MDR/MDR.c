@@ -16,43 +16,14 @@
    Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
  */
 /* libraries */
-#define __16f1847
-#include <pic16f1847.h>
-#include <stdint.h>
+#include "hal.h"
 #include "I2C.h"
-
-/* the peripherals connected to the pins */
-#define RELAY1 _RA2 /* pin 1 */
-#define RELAY2 _RA3 /* pin 2 only for MDR2 */
-/* pin 3 is connected to ground */
-/* pin 4 is used as master clear */
-/* pin 5 is Vss (ground) */
-#define SWITCH1 _RB0 /* pin 6 (on ground when pressed) */
-#define LED _RB1 /* pin 7 (used as sink) */
-#define SWITCH2 _RB2 /* pin 8 (on ground when pressed) */
-/* pin 9 is to identify board. Vdd for MDR, ground for MDR-U */
-/* pin 10 is not connected */
-/* pin 11 in not connected */
-/* pin 12, external 24LC256 EEPROM */
-/* pin 13, external 24LC256 EEPROM */
-/* pin 14 is Vdd (5V) */
-/* pin 15 is clonnected to external 4MHz ceramic resonator */
-/* pin 16 is clonnected to external 4MHz ceramic resonator */
-#define RADIO _RA0 /* radio signal receiver, filtered by LM358N */
-/* pin 18 is to identify board. Vdd for MDR, ground for MDR-U */
+#include "store.h"
+#include "receiver.h"
 
 /* simple functions */
-#define led_off() LATB |= LED
-#define led_on() LATB &= ~(LED)
 #define sleep() __asm sleep __endasm
 
-/* variables */
-static uint8_t switches; /* save the last switch state */
-#define START 208 /* starting timer 0 value to wait up to 12ms in start_timer*/
-static uint8_t code[3] = {0xf1, 0x11, 0x11}; /* the received code (24 bits) */
-static uint8_t new = 0; /* has a new code been detected (clear using button) */
-static uint8_t hold = 0; /* how long has the button been held, in 250ms steps */
-
 /* configuration bits */
 uint16_t __at(_CONFIG1) __CONFIG1 = _FCMEN_ON & /* enable fail-safe clock monitor */
                                     _IESO_ON & /* enable internal/external switchover (since fail-safe is enabled) */
@@ -90,39 +61,60 @@ void init (void) {
 	IOCBN |= (SWITCH1|SWITCH2); /* enable interrupt when switch is pressed */
 	switches = PORTB; /* save current switch state */
 
-	/* use timer 0 to measure bitframes timing */
-	TMR0CS = 1; /* disable timer 0 (T0CKI/RA4 is connected to ground) */
-	TMR0SE = 0; /* increment timer0 on low to high edge ((T0CKI/RA4 is connected to ground) */
-	PSA = 0; /* use presacler for timer 0 */
-	PS0 = 1; /* use prescaler of 256 */
-	PS1 = 1; /* use prescaler of 256 */
-	PS2 = 1; /* use prescaler of 256 */
-	TMR0IE = 1; /* enable timer 0 interrupt */
-	TMR0IF = 0; /* clear timer 0 interrupt */
-
-	/* use timer 2 to measure pulse durations (max 16.384ms) */
-	TMR2ON = 0; /* stop timer 2 */
-	T2CKPS0 = 1; /* use prescaler of 64 */
-	T2CKPS1 = 1; /* use prescaler of 64 */
-	T2OUTPS0 = 0; /* use postscale of 1 */
-	T2OUTPS1 = 0; /* use postscale of 1 */
-	T2OUTPS2 = 0; /* use postscale of 1 */
-	T2OUTPS3 = 0; /* use postscale of 1 */
-	PR2 = 0xff; /* set interrupt on overflow */
-	TMR2IE = 1; /* enable timer 2 interrupt */
-	TMR2IF = 0; /* clear timer 2 interrupt */
-
-	/* use timer 4 to measure button hold (250ms per interrupt) */
+	/* use timer 1 to timestamp the radio signal edges
+	 * speed is Fosc/4 with a prescaler of 8
+	 * each tick is 8us, and it overflows after 524ms
+	 */
+	TMR1ON = 0; /* stop timer 1 */
+	TMR1CS0 = 0; /* use Fosc/4 as clock source */
+	TMR1CS1 = 0; /* use Fosc/4 as clock source */
+	T1CKPS0 = 1; /* use prescaler of 8 */
+	T1CKPS1 = 1; /* use prescaler of 8 */
+	T1OSCEN = 0; /* the timer 1 oscillator is not used */
+	TMR1GE = 0; /* timer 1 always counts */
+	TMR1H = 0; /* reset timer */
+	TMR1L = 0; /* reset timer */
+	TMR1ON = 1; /* start timer 1 (free running) */
+
+	/* use comparator 1 to detect the radio signal edges
+	 * RA0 does not support interrupt on change, but the comparator output does, in both directions
+	 * the signal is compared to the DAC output, at about the digital input threshold
+	 * the comparator also works while sleeping, so it can wake us up
+	 */
+	ANSELA |= RADIO; /* the radio signal is an analog comparator input */
+	DACCON1 = 13; /* DAC output is Vdd*13/32 = 2.0V */
+	DACPSS0 = 0; /* use Vdd as DAC positive source */
+	DACPSS1 = 0; /* use Vdd as DAC positive source */
+	DACNSS = 0; /* use Vss as DAC negative source */
+	DACOE = 0; /* DAC output is only used internally */
+	DACEN = 1; /* enable DAC */
+	C1NCH0 = 0; /* use C12IN0- (RA0) as inverting input */
+	C1NCH1 = 0; /* use C12IN0- (RA0) as inverting input */
+	C1PCH0 = 1; /* use DAC as non-inverting input */
+	C1PCH1 = 0; /* use DAC as non-inverting input */
+	C1POL = 1; /* invert output so it is high when the radio signal is high */
+	C1HYS = 1; /* use hysteresis against noise */
+	C1SP = 1; /* use normal power, higher speed */
+	C1SYNC = 0; /* asynchronous output, so it can wake us up (timer 1 is off during sleep) */
+	C1OE = 0; /* the output is only used internally */
+	C1INTP = 1; /* interrupt on rising edge */
+	C1INTN = 1; /* interrupt on falling edge */
+	C1ON = 1; /* enable comparator */
+	C1IF = 0; /* clear comparator interrupt */
+	C1IE = 1; /* enable comparator interrupt */
+
+	/* use timer 4 as scheduler tick (10ms per interrupt) */
 	TMR4ON = 0; /* stop timer 4 */
 	T4CKPS0 = 1; /* use prescaler of 64 */
 	T4CKPS1 = 1; /* use prescaler of 64 */
-	T4OUTPS0 = 1; /* use postscale of 16 */
-	T4OUTPS1 = 1; /* use postscale of 16 */
-	T4OUTPS2 = 1; /* use postscale of 16 */
-	T4OUTPS3 = 1; /* use postscale of 16 */
-	PR4 = 244; /* set interrupt on overflow on this value to get 250ms */
+	T4OUTPS0 = 0; /* use postscale of 1 */
+	T4OUTPS1 = 0; /* use postscale of 1 */
+	T4OUTPS2 = 0; /* use postscale of 1 */
+	T4OUTPS3 = 0; /* use postscale of 1 */
+	PR4 = 155; /* set interrupt on overflow on this value to get 10ms */
 	TMR4IE = 1; /* enable timer 4 interrupt */
 	TMR4IF = 0; /* clear timer 4 interrupt */
+	TMR4ON = 1; /* start timer 4 */
 
 	/* the MDR originally uses a PIC16C54A (PDIP for MDR/MDR2, SOIC for MDR-U)
 	 * this does does not provide hardware I2C function
@@ -134,310 +126,58 @@ void init (void) {
 	TRISB &= ~(SCL|SDA); /* set as output (it must be driven because there is no pull-up */
 	LATB |= SCL|SDA; /* set as high (default pull-up state) */ 
 
-	PEIE = 1; /* enable peripheral interrupt (for timer 2) */
+	PEIE = 1; /* enable peripheral interrupt (for the comparator and timer 4) */
 	GIE = 1; /* golablly enable interrupts */
 }
 
-/* start timer to measure bitframe
- * returns the time (in 0.256ms steps) since the last start
- * stops after 12ms (then it returns 0)
- */
-uint8_t start_bit_timer(void)
-{
-	/* uses timer 0
-	 * speed is Fosc/4 with a prescaler of 256
-	 * each tick should be 1.0/((4000000/4)/256) = 0.0002560163850486431 seconds
-	 * since there should be one pulse every 6ms, only wait up to 12ms
-	 */
-	uint8_t time = TMR0-START; /* remember the time passed */
-	TMR0 = START; /* reset timer */
-	TMR0CS = 0; /* enable timer 0 */
-	return time;
-}
-
-/* start timer to measure pulse length
- * read the time from TMR2
- * step is 0.064ms
- * stops at 0xff (16.384ms)
- */
-void start_pulse_timer()
-{
-	TMR2 = 0; /* reset timer counter */
-	TMR2ON = 1; /* start timer 2 */
-}
-
-/* write code (global variable) in EEPROM at specifoed address */
-void write_code(uint16_t address)
-{
-	/* use I2C to select address */
-	send_start();
-	if (send_byte(0xa0)) { /* write eeprom at 0xA0/0x50 */
-		send_stop();
-		return;
-	}
-	if (send_byte((uint8_t)(address>>8))) { /* go to address */
-		send_stop();
-		return;
-	}
-	if (send_byte((uint8_t)(address&0xff))) { /* go to address */
-		send_stop();
-		return;
-	}
-	/* write bytes */
-	if (send_byte(code[0])) {
-		send_stop();
-		return;
-	}
-	if (send_byte(code[1])) {
-		send_stop();
-		return;
-	}
-	if (send_byte(code[2])) {
-		send_stop();
-		return;
-	}
-	/* finish transaction */
-	send_stop();
-}
-
-/* look in the memory for the code (global variable)
- * if not present, write it a the next free memory space
- * return 0 if the code is already in EEPROM
- * return 1 if the code is new and saved
- * return 2 if error occured
- * return 3 if no space in memory
- */
-uint8_t save_code(void)
-{
-	uint16_t address;
-	uint8_t stored[3];
-	/* start at begining of the memory */
-	send_start();
-	if (send_byte(0xa0)) { /* write address to eeprom at 0xA0/0x50 */
-		send_stop();
-		return 2;
-	}
-	if (send_byte(0x00)) { /* go to address 0x0000 */
-		send_stop();
-		return 2;
-	}
-	if (send_byte(0x00)) { /* go to address 0x0000 */
-		send_stop();
-		return 2;
-	}
-	/* start reading */
-	send_start();
-	if (send_byte(0xa1)) { /* read eeprom at 0xA0/0x50 */
-		send_stop();
-		return 2;
-	}
-	/* go through memory */
-	for (address=0; address<0x7FFF-2; address+=3) {
-		/* read stored code */
-		stored[0] = read_byte(1);
-		stored[1] = read_byte(1);
-		stored[2] = read_byte(1);
-		if ((stored[0]&0x80)==0) { /* code always have the MSb to 1 */
-			read_byte(0); /* send a NACK to stop reading */
-			send_stop(); /* finish transaction */
-			write_code(address); /* write code at this space */
-			return 1;
-		} else if (stored[0]==code[0] && stored[1]==code[1] && stored[2]==code[2]) { /* code already stored */
-			read_byte(0); /* send a NACK to stop reading */
-			send_stop(); /* finish transaction */
-			return 0;
-		}
-	}
-	return 3;
-}
-
-void clear_memory(void)
-{
-	uint16_t address;
-	uint16_t wait;
-	/* go through memory */
-	for (address=0; address<0x7FFF; address++) {
-		if ((address%0x40)==0) { /* select page */
-			send_start(); /* start transaction */
-			if (send_byte(0xa0)) { /* write address to eeprom at 0xA0/0x50 */
-				send_stop();
-				return;
-			}
-			if (send_byte(address>>8)) { /* go to address */
-				send_stop();
-				return;
-			}
-			if (send_byte(address&0xff)) { /* go to address */
-				send_stop();
-				return;
-			}
-		}
-		send_byte(0x00); /* clear byte */
-		if ((address%0x40)==0x3f) { /* end of page */
-			send_stop(); /* finish transaction */
-			for (wait=0; wait<1024; wait++); /* wait for eeprom to be writen */
-		}
-	}
-}
-
-/* read all codes from memory */
-void dump_codes(void)
-{
-	uint16_t address;
-	uint8_t stored[3];
-	/* start at begining of the memory */
-	send_start();
-	if (send_byte(0xa0)) { /* write address to eeprom at 0xA0/0x50 */
-		send_stop();
-		return;
-	}
-	if (send_byte(0x00)) { /* go to address 0x0000 */
-		send_stop();
-		return;
-	}
-	if (send_byte(0x00)) { /* go to address 0x0000 */
-		send_stop();
-		return;
-	}
-	/* start reading */
-	send_start();
-	if (send_byte(0xa1)) { /* read eeprom at 0xA0/0x50 */
-		send_stop();
-		return;
-	}
-	/* go through memory */
-	for (address=0; address<0x7FFF-2; address+=3) {
-		/* read stored code */
-		stored[0] = read_byte(1);
-		stored[1] = read_byte(1);
-		stored[2] = read_byte(1);
-		if ((stored[0]&0x80)==0) { /* code always have the MSb to 1 */
-			read_byte(0); /* send nack */
-			send_stop(); /* end transaction */
-			return; /* all codes have been read */
-		}
-	}
-}
-
 /* funcion called on interrupts */
 /* interrupt 0 is only one on PIC16 */
 static void interrupt(void) __interrupt 0
 {
+	uint16_t capture; /* the edge time */
+	if (C1IF) { /* radio signal edge, handle it first to timestamp it as precisely as possible */
+		read_timer(capture); /* get edge time */
+		capture_edge(capture, C1OUT); /* the output is high after a rising edge */
+		C1IF = 0; /* clear comparator interrupt */
+	}
 	if (IOCIF) { /* GPIO interrupt (typo in library?) */
 		if (IOCBF&(SWITCH1|SWITCH2)) { /* switch activity */
-			switches ^= PORTB; /* figure out which switch changed */
-			if (switches&SWITCH1) { /* switch 1 changed */
-				if (PORTB&SWITCH1) { /* switch 1 released */
-					led_off(); /* reset LED */
-					new = 0; /* clear new code status */
-					TMR4ON = 0; /* stop counting how long the button is held */
-				} else { /* switch 1 pressed */
-					led_on(); /* test LED */
-					hold = 0; /* reset counter how long the button is held */
-					TMR4ON = 1; /* start counting how long the button is held */
-				}
-			}
-			if (switches&SWITCH2) { /* switch 2 changed */
-			}
-			switches = PORTB; /* save current switch state */
+			switch_changed = 1; /* handled by the switch task */
 			IOCBF &= ~(SWITCH1|SWITCH2); /* clear switch interrupts */
 		}
 		IOCIF = 0; /* clear GPIO interrupt */
 	}
-	if (TMR0IF) { /* timer 0 overflow. no bit within required time */
-		TMR0CS = 1; /* stop timer 1 */
-		TMR0 = START; /* reset timer */
-		TMR0IF = 0; /* clear timer 0 interrupt */
-	}
-	if (TMR2IF) { /* timer 2 overflow. long pulse */
-		TMR2ON = 0; /* stop timer 2 */
-		TMR2 = 0xff; /* set timer 2 count to maximum */
-		TMR2IF = 0; /* clear timer 2 interrupt */
-	}
-	if (TMR4IF) { /* timer 4 overflow, 250ms passed during button press */
-		hold++; /* increment 250ms counter */
-		/* toggle LED */
-		if (hold%2) {
-			led_off();
-		} else {
-			led_on();
-		}
-		/* button pressed for 5s, clear memory */
-		if (hold==20) {
-			led_on();
-			if (!(PORTB&SWITCH1)) { /* ensure the button is pressed */
-				clear_memory();
-			}
-			led_off();
-			TMR4ON = 0;
-		}
+	if (TMR4IF) { /* timer 4 overflow, scheduler tick */
+		ticks++;
 		TMR4IF = 0; /* clear timer 4 interrupt */
 	}
 }
 
 void main (void)
 {
-	uint8_t rx = 0; /* are we receiving a pulse */
-	uint8_t bit = 0; /* the current received bit */
-	uint8_t time = 0; /* time since previous bitframe start, in 0.256ms steps */
-	uint16_t rc; /* return code */
-
 	init(); /* configure micro-controller */
-	dump_codes(); /* dump codes when powering up so a logic analyzer can get them */
+	init_store(); /* find the codes in the EEPROM */
+	if (!(switches&SWITCH1)) { /* switch 1 is pressed when powering up */
+		dump_codes(); /* dump codes so a logic analyzer can get them */
+		tasks |= TASK_DUMP; /* read the pages in the background */
+	}
 
 	while (1) { /* a microcontroller runs forever */
-		/* I can't go to sleep to safe power
-		 * the RADIO is connected to RA0, but port A does not support interrupt on change
-		 * the timers are off in sleep, except for timer 1 when externally driven, but this is not our case
-		 * the watchdog can only wake up every 1ms, but that is not fast enough and a pulse could be missed
+		receive(); /* decode the received edges */
+		switch_task();
+		relay_task();
+		store_task();
+		/* sleep to save power until the next radio edge or button press
+		 * the first edge after waking up is timestamped while the resonator starts up (using the internal oscillator), thus only go to sleep after the last transmission of a button press (and after the repeat window)
+		 * timers 1 and 4 stop during sleep, so stay awake while something is timed
 		 */
-		if (rx==0 && (PORTA&RADIO)) { /* pulse detected */
-			rx = 1; /* mark receiving start to wait until pulse is finished */
-			start_pulse_timer();
-		} else if (rx!=0 && !(PORTA&RADIO)) { /* end of pulse */
-                        rx = 0;
-			if (TMR2>=14) { /* only observe pulses >0.9ms */
-				/* pulse should be 1ms, but 1.2ms are used in the field
-
-				 * the first transmission can sometimes be detected a 10ms, even with a 1ms pulse
-				 * this is why the fallinf edge is used
-				 */
-				if (bit>0) { /* following pulses */
-					time += start_bit_timer(); /* get time and start measure time for next pulse */
-					if (time>=27 && time<=35) { /* pulse between 7 and 9 ms after previous bitframe start is a 0 */
-						time = 8; /* pulse is 2ms after bitframe start */
-						code[bit/8] &= ~(1<<(7-(bit%8))); /* store first bit=0 */
-						bit++; /* wait for next bit */
-					} else if (time>=40 && time<=47) { /* pulse between 10 and 12 ms after previous bitframe start is a 0 */
-						time = 20; /* the sync pulse is 5ms after bitframe start */
-						code[bit/8] |= 1<<(7-(bit%8)); /* store first bit=1 */
-						bit++; /* wait for next bit */
-					} else { /* unexpected pulse. code is broken */
-						bit = 0; /* restart from beginning for new code */
-					}
-					if (bit==24) { /* received all 24 bits */
-						led_on(); /* indicate activity */
-						rc = save_code(); /* save code in external EEPROM */
-						if (!new) { /* only switch led off if no new code has been detected (globally) */
-							led_off(); /* activity finished */
-						}
-						if (rc==1) { /* new code saved */
-							new = 1; /* remember a new code has been saved */
-							led_on(); /* indicate new code detected */
-							LATA |= RELAY1; /* switch relay on to make sound */
-							for (rc=0; rc<1024; rc++); /* wait a bit */
-							LATA &= ~RELAY1; /* switch relay off */
-						}
-					}
-				}
-				if (bit==0) { /* sync pulse (can be the current one it it is not a continuation */
-					start_bit_timer(); /* measure time until next bit */
-					time = 20; /* the sync pulse is 5ms after bitframe start */
-					code[bit/8] |= 1<<(7-(bit%8)); /* store first bit=1 */
-					bit++; /* wait for next bit */
-				}
+		if (idle && tasks==0 && code_out==code_in && (switches&SWITCH1) && (switches&SWITCH2) && !(LATA&(RELAY1|RELAY2))) {
+			flush_codes(); /* ensure everything is saved */
+			GIE = 0; /* don't let an interrupt happen between the check and the sleep */
+			if (edge_out==edge_in && !switch_changed) {
+				sleep(); /* the comparator or switch interrupt flag wakes us up even with interrupts disabled */
 			}
-		}		
+			GIE = 1; /* handle the interrupt which woke us up */
+		}
 	}
 }
-
@@ -0,0 +1,41 @@
+/* hardware abstraction for the MDR firmware
+ * the receiver logic only accesses the hardware through the definitions in here
+ * when compiled with HOST defined (see host/) the registers are variables of the simulation
+ */
+#include <stdint.h>
+#if defined(HOST)
+#include "host.h"
+#else
+#define __16f1847
+#include <pic16f1847.h>
+#endif
+
+/* the peripherals connected to the pins */
+#define RELAY1 _RA2 /* pin 1 */
+#define RELAY2 _RA3 /* pin 2 only for MDR2 */
+/* pin 3 is connected to ground */
+/* pin 4 is used as master clear */
+/* pin 5 is Vss (ground) */
+#define SWITCH1 _RB0 /* pin 6 (on ground when pressed) */
+#define LED _RB1 /* pin 7 (used as sink) */
+#define SWITCH2 _RB2 /* pin 8 (on ground when pressed) */
+/* pin 9 is to identify board. Vdd for MDR, ground for MDR-U */
+/* pin 10 is not connected */
+/* pin 11 in not connected */
+/* pin 12, external 24LC256 EEPROM */
+/* pin 13, external 24LC256 EEPROM */
+/* pin 14 is Vdd (5V) */
+/* pin 15 is clonnected to external 4MHz ceramic resonator */
+/* pin 16 is clonnected to external 4MHz ceramic resonator */
+#define RADIO _RA0 /* radio signal receiver, filtered by LM358N (C12IN0- comparator input) */
+/* pin 18 is to identify board. Vdd for MDR, ground for MDR-U */
+
+/* simple functions */
+#define led_off() LATB |= LED
+#define led_on() LATB &= ~(LED)
+#if defined(HOST)
+#define read_timer(time) time = (uint16_t)timer1
+#else
+/* read timer 1 (the high byte can change while reading the low byte) */
+#define read_timer(time) do { time = TMR1H; time = (time<<8)|TMR1L; } while ((uint8_t)(time>>8)!=TMR1H)
+#endif
@@ -0,0 +1,146 @@
+/* emulated 24LC256 I2C EEPROM for the host build of the MDR firmware
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* this replaces I2C.c: instead of bit banging, the transactions are applied to a memory array
+ * the time spent on the bus is counted in I2C clock periods (I2C_KHZ), and the write cycles last 5ms (the 24LC256 maximum)
+ * while writing the EEPROM does not acknowledge its address, like the real one
+ */
+/* libraries */
+#include <stdint.h>
+#include "I2C.h"
+#include "store.h"
+
+#define CLOCK (1000000/I2C_KHZ) /* I2C clock period, in ns */
+#define WRITE_CYCLE 5000000 /* write cycle time, in ns */
+
+uint8_t eeprom[MEMORY]; /* the memory starts cleared */
+uint64_t eeprom_clock = 0;
+uint32_t eeprom_writes = 0;
+
+/* the transaction state */
+enum state {
+	IDLE, /* no transaction */
+	DEVICE, /* start sent, waiting for device address */
+	ADDRESS_HIGH, /* waiting for the address */
+	ADDRESS_LOW,
+	WRITE, /* receiving data to write */
+	READ, /* sending data */
+};
+static enum state state = IDLE;
+static uint16_t address = 0; /* the address pointer */
+static uint64_t busy = 0; /* end of the write cycle */
+/* the data received in the current write, applied at the stop condition */
+static uint8_t page[PAGE];
+static uint8_t page_nb = 0; /* number of bytes received (the address wraps within the page) */
+
+void send_start(void)
+{
+	eeprom_clock += CLOCK;
+	page_nb = 0; /* a write is only started by a stop condition */
+	state = DEVICE;
+}
+
+void send_stop(void)
+{
+	uint8_t i;
+	eeprom_clock += CLOCK;
+	if (state==WRITE && page_nb>0) { /* start write cycle */
+		for (i=0; i<page_nb && i<PAGE; i++) {
+			eeprom[(address&~(PAGE-1))|((address+i)&(PAGE-1))] = page[i];
+		}
+		busy = eeprom_clock+WRITE_CYCLE;
+		eeprom_writes++;
+	}
+	page_nb = 0;
+	state = IDLE;
+}
+
+uint8_t send_byte(uint8_t byte)
+{
+	eeprom_clock += 9*CLOCK; /* 8 bits and the ack */
+	switch (state) {
+	case DEVICE:
+		if (eeprom_clock<busy) { /* no ack while writing */
+			state = IDLE;
+			return 1;
+		}
+		if (byte==0xa0) {
+			state = ADDRESS_HIGH;
+		} else if (byte==0xa1) {
+			state = READ;
+		} else { /* not our address */
+			state = IDLE;
+			return 1;
+		}
+		return 0;
+	case ADDRESS_HIGH:
+		address = (uint16_t)(byte&((MEMORY-1)>>8))<<8;
+		state = ADDRESS_LOW;
+		return 0;
+	case ADDRESS_LOW:
+		address |= byte;
+		state = WRITE;
+		return 0;
+	case WRITE:
+		page[page_nb%PAGE] = byte; /* the address wraps within the page */
+		if (page_nb<0xff) {
+			page_nb++;
+		}
+		return 0;
+	default:
+		return 1;
+	}
+}
+
+uint8_t read_byte(uint8_t ack)
+{
+	uint8_t byte = 0xff; /* bus is high when nobody drives it */
+	eeprom_clock += 9*CLOCK; /* 8 bits and the ack */
+	if (state==READ) {
+		byte = eeprom[address];
+		address = (address+1)&(MEMORY-1); /* sequential read wraps around the whole memory */
+		if (!ack) { /* end of read */
+			state = IDLE;
+		}
+	}
+	return byte;
+}
+
+void read_bytes(uint8_t* bytes, uint8_t length, uint8_t nack)
+{
+	while (length>1) {
+		*bytes++ = read_byte(1);
+		length--;
+	}
+	if (length) {
+		*bytes = read_byte(!nack);
+	}
+}
+
+uint8_t poll_ack(uint8_t address)
+{
+	uint8_t retry;
+	for (retry=0; retry<0xff; retry++) {
+		send_start();
+		if (!send_byte(address)) { /* device acknowledged */
+			send_stop();
+			return 0;
+		}
+	}
+	send_stop();
+	return 1;
+}
@@ -0,0 +1,25 @@
+/* simulated micro-controller for the host build of the MDR firmware (see replay.c)
+ * only the registers used by the receiver logic are provided, as variables
+ */
+#include <stdint.h>
+
+/* pin masks, as in the sdcc device header */
+#define _RA0 0x01
+#define _RA1 0x02
+#define _RA2 0x04
+#define _RA3 0x08
+#define _RB0 0x01
+#define _RB1 0x02
+#define _RB2 0x04
+#define _RB6 0x40
+#define _RB7 0x80
+
+extern uint8_t LATA; /* relays */
+extern uint8_t LATB; /* LED */
+extern uint8_t PORTB; /* switches */
+extern uint32_t timer1; /* timer 1, in 8us ticks */
+
+/* the emulated 24LC256 EEPROM (see eeprom.c) */
+extern uint8_t eeprom[]; /* memory content */
+extern uint64_t eeprom_clock; /* current time of the I2C bus, in ns */
+extern uint32_t eeprom_writes; /* number of write cycles */
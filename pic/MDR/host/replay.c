@@ -0,0 +1,184 @@
+/* replay radio captures through the MDR receiver logic on a computer
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* the captures are the AM raw audio files generated by rtl_fm (see sdr/), used as the signal on the RADIO pin
+ * the comparator interrupt is replaced by a threshold on the samples, the main loop is run between the samples
+ * while the main loop waits for the EEPROM (emulated), the edges are still captured, like with the real interrupt
+ * the EEPROM content is kept from one file to the next
+ */
+/* libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "hal.h"
+#include "store.h"
+#include "receiver.h"
+
+#define RATE 24000 /* the sample rate of the captures, in Hz */
+#define THRESHOLD (((1<<16)/2)/2) /* the comparator threshold (samples are little endian signed 16 bits integers) */
+#define SILENCE 1 /* how long to continue after the end of a capture, in s (to finish the tasks) */
+
+/* the simulated registers */
+uint8_t LATA = 0;
+uint8_t LATB = 0;
+uint8_t PORTB = 0xff; /* switches are released */
+uint32_t timer1 = 0;
+
+/* the simulation state, carried from one file to the next */
+static uint64_t now = 0; /* simulated time, in ns */
+static uint64_t loop = 0; /* when the main loop runs next (it waits for the EEPROM), in ns */
+static uint8_t level = 0; /* the comparator output */
+static uint32_t dropped = 0; /* number of edges lost because the FIFO was full */
+static uint32_t gates = 0; /* number of times a relay has been switched on */
+static uint64_t eeprom_time = 0; /* time spent in the storage task, in ns */
+
+/* advance the simulation by one sample */
+static void step(int16_t sample)
+{
+	uint64_t start;
+	uint8_t relays;
+	now += 1000000000/RATE;
+	timer1 = (uint32_t)(now/8000); /* timer 1 ticks are 8us */
+	ticks = (uint8_t)(now/(TICK*1000000)); /* timer 4 interrupt */
+	/* comparator interrupt
+	 * the strong signals overflow in the rtl_fm output and wrap to negative values, thus the magnitude is used
+	 */
+	if ((!level && abs(sample)>THRESHOLD) || (level && abs(sample)<THRESHOLD)) {
+		level = !level;
+		if (((edge_in+1)&(EDGES-1))==edge_out) {
+			dropped++;
+		}
+		capture_edge((uint16_t)timer1, level);
+	}
+	/* main loop */
+	if (now<loop) { /* still waiting for the EEPROM */
+		return;
+	}
+	relays = LATA&(RELAY1|RELAY2);
+	receive();
+	switch_task();
+	relay_task();
+	if ((LATA&(RELAY1|RELAY2))&~relays) {
+		gates++;
+	}
+	relays = LATA&(RELAY1|RELAY2);
+	if (eeprom_clock<now) { /* the bus has been idle until now */
+		eeprom_clock = now;
+	}
+	start = eeprom_clock;
+	store_task();
+	if ((LATA&(RELAY1|RELAY2))&~relays) {
+		gates++;
+	}
+	eeprom_time += eeprom_clock-start;
+	loop = eeprom_clock;
+}
+
+/* replay a capture and print the statistics */
+static int replay(const char* path)
+{
+	FILE* file;
+	uint8_t raw[2];
+	uint32_t i;
+	uint16_t frames_start = frames, rejected_start = rejected, drift_start = drift_frames;
+	uint32_t dropped_start = dropped, gates_start = gates, writes_start = eeprom_writes;
+	uint64_t eeprom_start = eeprom_time;
+	uint16_t decoded;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+	while (fread(raw, 1, sizeof(raw), file)==sizeof(raw)) {
+		step((int16_t)(raw[0]|(raw[1]<<8)));
+	}
+	fclose(file);
+	for (i=0; i<SILENCE*RATE; i++) { /* let the tasks finish */
+		step(0);
+	}
+	decoded = frames-frames_start;
+	printf("%s:\n", path);
+	printf("# frames: %u\n", decoded);
+	printf("# rejected: %u\n", (uint16_t)(rejected-rejected_start));
+	printf("# drift: %u\n", (uint16_t)(drift_frames-drift_start));
+	printf("# dropped edges: %u\n", dropped-dropped_start);
+	printf("# gate activations: %u\n", gates-gates_start);
+	printf("# EEPROM writes: %u\n", eeprom_writes-writes_start);
+	printf("# EEPROM time: %.3f ms", (eeprom_time-eeprom_start)/1e6);
+	if (decoded) {
+		printf(" (%.3f ms/frame)", (eeprom_time-eeprom_start)/1e6/decoded);
+	}
+	printf("\n");
+	return 0;
+}
+
+/* print the codes saved in the EEPROM */
+static void print_codes(void)
+{
+	uint32_t address;
+	uint8_t bit;
+	printf("codes:\n");
+#if defined(STORE_LINEAR)
+	for (address=0; address<MEMORY; address++) {
+		for (bit=0; bit<8; bit++) {
+			if (eeprom[address]&(1<<bit)) { /* the code 0xABCDEF is at 0x(B&7)ECD, bit F/2, the MSb is always set and the rest is lost */
+				printf("- code: 0X8%01x%02x%01x%01x, channels: %u\n", (unsigned)(address>>12), (unsigned)(address&0xff), (unsigned)((address>>8)&0x0f), bit<<1, CHANNEL1);
+			}
+		}
+	}
+#else
+	uint16_t next = ((uint16_t)eeprom[6]<<8)|eeprom[7]; /* from the header */
+	(void)bit;
+	for (address=PAGE; address<next && address<MEMORY; address+=SLOT) {
+		printf("- code: 0X%02x%02x%02x, channels: %u\n", eeprom[address], eeprom[address+1], eeprom[address+2], eeprom[address+3]);
+	}
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+	int arg = 1;
+	int rc = 0;
+	if (argc>1 && strcmp(argv[1], "-l")==0) { /* hold the learn button for channel 1 */
+		PORTB &= ~SWITCH1;
+		arg++;
+	}
+	if (arg>=argc) {
+		fprintf(stderr, "usage: %s [-l] capture.pcm...\n", argv[0]);
+		fprintf(stderr, "replay AM raw audio captures (from rtl_fm, 24kHz) through the MDR receiver\n");
+		fprintf(stderr, "-l: hold the learn button, to authorize the received codes for channel 1\n");
+		return 1;
+	}
+	switches = PORTB;
+	init_store(); /* read the header of the emulated EEPROM */
+	for (; arg<argc; arg++) {
+		rc |= replay(argv[arg]);
+	}
+	print_codes();
+	printf("total:\n");
+	printf("# frames: %u\n", frames);
+	printf("# rejected: %u\n", rejected);
+	printf("# drift: %u\n", drift_frames);
+	printf("# EEPROM time: %.3f ms", eeprom_time/1e6);
+	if (frames) {
+		printf(" (%.3f ms/frame)", eeprom_time/1e6/frames);
+	}
+	printf("\n");
+	return rc;
+}
@@ -0,0 +1,376 @@
+/* receiver logic (decoding, authorization, tasks) for the Linear MDR/MDR2/MDR-U receiver firmware
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* libraries */
+#include <stdint.h>
+#include "hal.h"
+#include "store.h"
+#include "receiver.h"
+
+/* variables */
+uint8_t switches; /* save the last switch state */
+volatile uint16_t edges[EDGES];
+volatile uint8_t edge_in = 0; /* where the next edge will be saved */
+volatile uint8_t edge_out = 0; /* the next edge to decode */
+static uint8_t code[3] = {0xf1, 0x11, 0x11}; /* the received code (24 bits) */
+/* the received codes waiting to be saved in EEPROM
+ * they are only saved while no transmission is ongoing, so receiving never waits for the EEPROM
+ */
+#define CODES 8 /* ring buffer size, power of 2 */
+static uint8_t codes[CODES][3];
+static uint8_t codes_learn[CODES]; /* the channels to authorize the code for (the switches pressed when it has been received) */
+uint8_t code_in = 0; /* where the next received code will be saved */
+uint8_t code_out = 0; /* the next code to save in EEPROM */
+/* the last received code
+ * a remote repeats the code as long as the button is held, these repeats are ignored
+ */
+#define REPEAT MS(500) /* ignore the same code if received again within this time (longer than the pause between two transmissions) */
+static uint8_t seen[3];
+static uint16_t seen_time; /* when the last code has been received */
+static uint8_t seen_valid = 0; /* if the last code is still recent */
+static uint8_t new = 0; /* has a new code been detected (clear using button) */
+/* the recently used codes, to authorize them without reading the EEPROM
+ * the most recently used code is first, the least recently used is replaced
+ */
+#define CACHE 8 /* number of codes in the cache */
+static uint8_t cache[CACHE][3];
+static uint8_t cache_channels[CACHE]; /* the channels the code is authorized for */
+static uint8_t cache_nb = 0; /* number of codes in the cache */
+/* the bitframe period is tracked while receiving, to follow remotes with a drifting oscillator */
+#define PERIOD MS(6) /* nominal bitframe period */
+#define PERIOD_MIN MS(5.4) /* don't follow the period further than 10% off, to keep rejecting noise */
+#define PERIOD_MAX MS(6.6)
+/* decoding statistics */
+uint16_t frames = 0;
+uint16_t rejected = 0;
+uint16_t drift_frames = 0;
+/* the receive state, updated by receive() */
+uint8_t quiet = 1; /* no edge since 2 bitframes, no transmission is ongoing */
+uint8_t idle = 1; /* no edge since long, we can sleep */
+/* the scheduler */
+#define TICKS(ms) (uint8_t)((ms)/TICK) /* convert milliseconds in ticks */
+#define elapsed(since, duration) ((uint8_t)(ticks-(since))>=(duration)) /* has the duration passed since the tick time (up to 255 ticks) */
+volatile uint8_t ticks = 0; /* the scheduler time, incremented every tick */
+volatile uint8_t switch_changed = 0; /* a switch state changed */
+uint8_t tasks = 0; /* the long tasks to run (only one at a time) */
+static uint8_t hold = 0xff; /* how long has the button been held, in 250ms steps (0xff when released) */
+static uint8_t hold_tick; /* when the button hold has been counted last */
+#define RELAY_TIME TICKS(500) /* how long to switch the relay on to activate the gate */
+static uint8_t relay_tick; /* when the relays have been switched on */
+
+/* look for the code in the cache
+ * return its position, or CACHE if it is not cached
+ */
+static uint8_t cached(uint8_t* code)
+{
+	uint8_t i;
+	for (i=0; i<cache_nb; i++) {
+		if (cache[i][0]==code[0] && cache[i][1]==code[1] && cache[i][2]==code[2]) {
+			return i;
+		}
+	}
+	return CACHE;
+}
+
+/* put the code first in the cache (as most recently used) */
+static void cache_code(uint8_t* code, uint8_t channels)
+{
+	uint8_t i = cached(code);
+	if (i==CACHE) { /* not cached yet, replace the least recently used */
+		if (cache_nb<CACHE) {
+			cache_nb++;
+		}
+		i = cache_nb-1;
+	}
+	for (; i>0; i--) { /* move the more recently used codes back */
+		cache[i][0] = cache[i-1][0];
+		cache[i][1] = cache[i-1][1];
+		cache[i][2] = cache[i-1][2];
+		cache_channels[i] = cache_channels[i-1];
+	}
+	cache[0][0] = code[0];
+	cache[0][1] = code[1];
+	cache[0][2] = code[2];
+	cache_channels[0] = channels;
+}
+
+/* switch on the relays of the channels (the relay task switches them off) */
+static void relay_on(uint8_t channels)
+{
+	if (channels&CHANNEL1) {
+		LATA |= RELAY1;
+	}
+	if (channels&CHANNEL2) {
+		LATA |= RELAY2; /* the relay is only populated on the MDR-2 */
+	}
+	relay_tick = ticks;
+}
+
+/* decode the edges timestamped in the comparator interrupt
+ * the timing does not depend on how fast we get here, as long as the FIFO does not overflow
+ */
+void receive(void)
+{
+	static uint16_t last = 0; /* time of the last edge */
+	static uint16_t rise = 0; /* time of the last rising edge */
+	static uint16_t frame = 0; /* time of the last bit pulse end */
+	static uint16_t position = 0; /* position of the last bit pulse end within its bitframe */
+	static uint8_t bit = 0; /* the current received bit */
+	static uint16_t period = PERIOD; /* estimated bitframe period of the current frame */
+	static uint8_t drift = 0; /* has a bit been decoded only thanks to the period tracking in the current frame */
+	uint16_t edge; /* the edge to decode (time and level) */
+	uint16_t now; /* the current time */
+	uint16_t time; /* time since previous bitframe start */
+	uint16_t interval; /* time since previous bit pulse */
+	int16_t delta; /* difference between the estimated and the nominal period */
+	uint8_t value; /* the decoded bit value (2 if it could not be decoded) */
+	uint8_t nominal; /* the bit value decoded using the nominal period */
+	uint8_t learn; /* the channels to learn the code for */
+	uint8_t i;
+
+	while (edge_out!=edge_in) {
+		edge = edges[edge_out];
+		edge_out = (edge_out+1)&(EDGES-1);
+		last = edge&0xfffe; /* remove the level, it could be after the current time */
+		quiet = 0;
+		idle = 0;
+		if (edge&1) { /* rising edge, start of pulse */
+			rise = edge;
+			continue;
+		}
+		/* falling edge, end of pulse */
+		if ((uint16_t)(edge-rise)<MS(0.9)) { /* only observe pulses >0.9ms */
+			continue;
+		}
+		/* pulse should be 1ms, but 1.2ms are used in the field
+		 * the first transmission can sometimes be detected a 10ms, even with a 1ms pulse
+		 * this is why the falling edge is used
+		 */
+		if (bit>0) { /* following pulses */
+			interval = edge-frame;
+			time = interval+position; /* time since previous bitframe start */
+			frame = edge; /* measure time for next pulse */
+			/* the windows are scaled with the estimated period (using shifts since there is no hardware division)
+			 * only the difference to the nominal period is scaled, so at 6ms they are exactly the fixed windows below
+			 * a 0 is 1.15-1.53 periods after the previous bitframe start (6.9-9.2ms at 6ms)
+			 * a 1 is 1.70-2.05 periods after the previous bitframe start (10.2-12.3ms at 6ms)
+			 */
+			delta = period-PERIOD;
+			if (time>=(uint16_t)(MS(6.9)+delta+(delta>>3)+(delta>>6)) && time<(uint16_t)(MS(9.2)+delta+(delta>>1)+(delta>>5))) {
+				value = 0;
+			} else if (time>=(uint16_t)(MS(10.2)+delta+(delta>>1)+(delta>>3)+(delta>>4)) && time<(uint16_t)(MS(12.3)+(delta<<1)+(delta>>5)+(delta>>6))) {
+				value = 1;
+			} else {
+				value = 2;
+			}
+			/* how the pulse would have been decoded without tracking the period */
+			if (time>=MS(6.9) && time<MS(9.2)) { /* pulse between 7 and 9 ms after previous bitframe start is a 0 */
+				nominal = 0;
+			} else if (time>=MS(10.2) && time<MS(12.3)) { /* pulse between 10 and 12 ms after previous bitframe start is a 1 */
+				nominal = 1;
+			} else {
+				nominal = 2;
+			}
+			if (value!=nominal) {
+				drift = 1;
+			}
+			if (value==2) { /* unexpected pulse. code is broken */
+				if (bit>1) { /* not only a sync pulse (it could be noise) */
+					rejected++;
+				}
+				bit = 0; /* restart from beginning for new code */
+			} else {
+				/* measure the period from the interval between the pulses
+				 * the pulses are 2ms (0) or 5ms (1) after the bitframe start
+				 * 0 to 0 and 1 to 1 are one period apart, 1 to 0 half a period, and 0 to 1 one and a half period
+				 */
+				if (position>(period>>1)) { /* previous bit was a 1 */
+					if (value==0) {
+						interval <<= 1;
+					}
+				} else if (value==1) { /* 0 followed by 1, take 2/3 of the interval */
+					interval = (interval>>1)+(interval>>3)+(interval>>5)+(interval>>7);
+				}
+				if (interval>=PERIOD_MIN && interval<=PERIOD_MAX) { /* follow the period slowly to be robust against jitter */
+					period = period-(period>>2)+(interval>>2);
+				}
+				delta = period-PERIOD;
+				if (value==0) {
+					position = MS(2)+(delta>>2)+(delta>>4)+(delta>>6); /* pulse is 1/3 period (2ms) after bitframe start */
+					code[bit/8] &= ~(1<<(7-(bit%8))); /* store bit=0 */
+				} else {
+					position = MS(5)+delta-(delta>>3)-(delta>>5)-(delta>>7); /* pulse is 5/6 period (5ms) after bitframe start */
+					code[bit/8] |= 1<<(7-(bit%8)); /* store bit=1 */
+				}
+				bit++; /* wait for next bit */
+			}
+			if (bit==24) { /* received all 24 bits */
+				bit = 0; /* wait for next code */
+				frames++;
+				if (drift) { /* the fixed windows would have lost this frame */
+					drift_frames++;
+				}
+				if (seen_valid && seen[0]==code[0] && seen[1]==code[1] && seen[2]==code[2]) { /* same code repeated */
+					seen_time = edge; /* the button is still held */
+					continue;
+				}
+				seen[0] = code[0];
+				seen[1] = code[1];
+				seen[2] = code[2];
+				seen_time = edge;
+				seen_valid = 1;
+				/* the switches are the learn buttons of the channels */
+				learn = 0;
+				if (!(switches&SWITCH1)) {
+					learn |= CHANNEL1;
+				}
+				if (!(switches&SWITCH2)) {
+					learn |= CHANNEL2;
+				}
+				i = cached(code);
+				if (i!=CACHE && !learn) { /* the code is known, no need to look in the EEPROM */
+					relay_on(cache_channels[i]); /* activate the gate right away */
+					cache_code(code, cache_channels[i]); /* mark as most recently used */
+				} else if (((code_in+1)&(CODES-1))!=code_out) { /* only save if there is space in the ring buffer */
+					codes[code_in][0] = code[0];
+					codes[code_in][1] = code[1];
+					codes[code_in][2] = code[2];
+					codes_learn[code_in] = learn;
+					code_in = (code_in+1)&(CODES-1);
+					led_on(); /* indicate activity */
+				}
+				continue; /* the sync pulse of the next code will follow */
+			}
+		}
+		if (bit==0) { /* sync pulse (can be the current one it it is not a continuation */
+			frame = edge; /* measure time until next bit */
+			period = PERIOD; /* start with the nominal period, the following bits will correct it */
+			drift = 0;
+			position = MS(5); /* the sync pulse is 5ms after bitframe start */
+			code[bit/8] |= 1<<(7-(bit%8)); /* store first bit=1 */
+			bit++; /* wait for next bit */
+		}
+	}
+	/* figure out if a transmission is ongoing
+	 * the time is compared as long as the flags are not set, so before timer 1 overflows
+	 */
+	read_timer(now);
+	if (!quiet && (uint16_t)(now-last)>=MS(13)) { /* no pulse within 2 bitframes */
+		quiet = 1;
+		if (bit>1) { /* the code is incomplete */
+			rejected++;
+		}
+		bit = 0; /* code is broken or finished */
+	}
+	if (!idle && (uint16_t)(now-last)>=MS(500)) { /* no transmission since longer than the pause between two transmissions */
+		idle = 1;
+	}
+	if (seen_valid && (idle || (uint16_t)(now-seen_time)>=REPEAT)) { /* the last code is not recent anymore */
+		seen_valid = 0;
+	}
+}
+
+/* switch task: handle button presses and hold */
+void switch_task(void)
+{
+	uint8_t changed;
+	if (switch_changed) {
+		switch_changed = 0;
+		changed = switches^PORTB; /* figure out which switch changed */
+		switches ^= changed; /* save current switch state */
+		if (changed&SWITCH1) { /* switch 1 changed */
+			if (switches&SWITCH1) { /* switch 1 released */
+				led_off(); /* reset LED */
+				new = 0; /* clear new code status */
+				hold = 0xff; /* stop counting how long the button is held */
+			} else { /* switch 1 pressed */
+				led_on(); /* test LED */
+				hold = 0; /* reset counter how long the button is held */
+				hold_tick = ticks; /* start counting how long the button is held */
+			}
+		}
+		if (changed&SWITCH2) { /* switch 2 changed */
+		}
+	}
+	if (hold<20 && elapsed(hold_tick, TICKS(250))) { /* 250ms passed during button press */
+		hold_tick += TICKS(250);
+		hold++; /* increment 250ms counter */
+		/* toggle LED */
+		if (hold%2) {
+			led_off();
+		} else {
+			led_on();
+		}
+		/* button pressed for 5s, clear memory */
+		if (hold==20 && !(PORTB&SWITCH1)) { /* ensure the button is pressed */
+			led_on(); /* indicate clearing */
+			clear_memory();
+			cache_nb = 0; /* forget the cached codes */
+			tasks |= TASK_CLEAR; /* erase the pages in the background */
+		}
+	}
+}
+
+/* relay task: switch the relays off once the pulse is over */
+void relay_task(void)
+{
+	if ((LATA&(RELAY1|RELAY2)) && elapsed(relay_tick, RELAY_TIME)) {
+		LATA &= ~(RELAY1|RELAY2); /* switch relays off */
+	}
+}
+
+/* storage task: do one EEPROM operation at a time, only while no transmission is ongoing */
+void store_task(void)
+{
+	uint8_t rc; /* return code */
+	uint8_t channels; /* the channels the code is authorized for */
+	if (!quiet) { /* don't use the time to decode the transmission */
+		return;
+	}
+	if (tasks&TASK_CLEAR) { /* clearing has priority since it discards the codes */
+		if (!clear_next()) { /* all pages cleared */
+			tasks &= ~TASK_CLEAR;
+			led_off(); /* clearing finished */
+		}
+	} else if (code_out!=code_in) { /* save the received codes, one at a time */
+		channels = codes_learn[code_out];
+		rc = save_code(codes[code_out], &channels); /* save code in external EEPROM */
+		if (rc==4) { /* the lookup continues on the next run */
+			return;
+		}
+		if (rc<2) { /* the code is known now */
+			cache_code(codes[code_out], channels);
+			if (!codes_learn[code_out]) { /* activate the gate if the code is authorized (but not while learning) */
+				relay_on(channels);
+			}
+		}
+		code_out = (code_out+1)&(CODES-1);
+		if (!new) { /* only switch led off if no new code has been detected (globally) */
+			led_off(); /* activity finished */
+		}
+		if (rc==1) { /* new code saved */
+			new = 1; /* remember a new code has been saved */
+			led_on(); /* indicate new code detected */
+		}
+	} else if (tasks&TASK_DUMP) {
+		if (!dump_next()) { /* all pages read */
+			tasks &= ~TASK_DUMP;
+		}
+	} else if (idle) { /* only once the button presses are over, so the codes received meanwhile are written together (and the header only once) */
+		flush_codes(); /* write the new codes kept in RAM */
+	}
+}
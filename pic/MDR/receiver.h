@@ -0,0 +1,55 @@
+/* the receiver logic of the MDR firmware: radio decoding, code authorization, and the tasks
+ * the micro-controller specific parts (configuration, interrupt, sleep) are in MDR.c
+ */
+#include <stdint.h>
+
+/* convert milliseconds in timer 1 ticks (8us) */
+#define MS(ms) (uint16_t)((ms)*125)
+
+/* the radio signal edges captured by the comparator interrupt, waiting to be decoded
+ * the value is the timer 1 time, with the LSb replaced by the signal level after the edge
+ */
+#define EDGES 16 /* FIFO size, power of 2 */
+extern volatile uint16_t edges[EDGES];
+extern volatile uint8_t edge_in; /* where the next edge will be saved */
+extern volatile uint8_t edge_out; /* the next edge to decode */
+/* save an edge in the FIFO (dropped if it is full), to be used in the interrupt */
+#define capture_edge(time, rising) do { \
+	if (((edge_in+1)&(EDGES-1))!=edge_out) { \
+		edges[edge_in] = (rising) ? ((time)|1) : ((time)&0xfffe); \
+		edge_in = (edge_in+1)&(EDGES-1); \
+	} \
+} while (0)
+
+/* the received codes waiting to be saved in EEPROM */
+extern uint8_t code_in; /* where the next received code will be saved */
+extern uint8_t code_out; /* the next code to save in EEPROM */
+
+/* the receive state, updated by receive() */
+extern uint8_t quiet; /* no edge since 2 bitframes, no transmission is ongoing */
+extern uint8_t idle; /* no edge since long, we can sleep */
+/* decoding statistics (read them using the debugger) */
+extern uint16_t frames; /* number of frames decoded (including repeats) */
+extern uint16_t rejected; /* number of frames broken after the first bits */
+extern uint16_t drift_frames; /* number of frames decoded only thanks to the period tracking */
+
+/* the scheduler
+ * the interrupts only set flags and timestamps, everything else is done by tasks in the main loop
+ * the tasks must return quickly (they continue on the next run) so the radio edges are decoded often enough
+ */
+#define TICK 10 /* scheduler tick period, in ms */
+extern volatile uint8_t ticks; /* the scheduler time, incremented every tick */
+extern uint8_t switches; /* save the last switch state */
+extern volatile uint8_t switch_changed; /* a switch state changed */
+#define TASK_CLEAR 0x01 /* clear the memory */
+#define TASK_DUMP 0x02 /* dump the memory */
+extern uint8_t tasks; /* the long tasks to run (only one at a time) */
+
+/* decode the edges timestamped in the comparator interrupt */
+void receive(void);
+/* switch task: handle button presses and hold */
+void switch_task(void);
+/* relay task: switch the relays off once the pulse is over */
+void relay_task(void);
+/* storage task: do one EEPROM operation at a time, only while no transmission is ongoing */
+void store_task(void);
@@ -0,0 +1,405 @@
+/* storage of the received codes in the external EEPROM for the Linear MDR/MDR2/MDR-U receiver firmware
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* libraries */
+#include <stdint.h>
+#include "I2C.h"
+#include "store.h"
+
+/* start a transaction at the specified address
+ * return 0 if the EEPROM acknowledged
+ * on error the transaction is stopped
+ */
+static uint8_t select_address(uint16_t address)
+{
+	send_start();
+	if (send_byte(0xa0)) { /* write address to eeprom at 0xA0/0x50 */
+		send_stop();
+		return 1;
+	}
+	if (send_byte((uint8_t)(address>>8))) { /* go to address */
+		send_stop();
+		return 1;
+	}
+	if (send_byte((uint8_t)(address&0xff))) { /* go to address */
+		send_stop();
+		return 1;
+	}
+	return 0;
+}
+
+/* start reading at the specified address
+ * return 0 if the EEPROM acknowledged
+ * on error the transaction is stopped
+ */
+static uint8_t start_read(uint16_t address)
+{
+	if (select_address(address)) {
+		return 1;
+	}
+	send_start();
+	if (send_byte(0xa1)) { /* read eeprom at 0xA0/0x50 */
+		send_stop();
+		return 1;
+	}
+	return 0;
+}
+
+#if defined(STORE_LINEAR)
+/* get the address of the byte for the code
+ * for the code 0xABCDEF the address is 0x(B&7)ECD
+ */
+static uint16_t code_address(uint8_t* code)
+{
+	return ((uint16_t)(code[0]&0x07)<<12)|((uint16_t)(code[2]&0xf0)<<4)|code[1];
+}
+
+uint8_t save_code(uint8_t* code, uint8_t* channels)
+{
+	uint16_t address = code_address(code);
+	uint8_t mask = 1<<((code[2]&0x0f)>>1); /* bit F/2 is set if the code is saved (odd values are rounded down) */
+	uint8_t stored;
+	/* read the byte for this code */
+	if (start_read(address)) {
+		return 2;
+	}
+	stored = read_byte(0); /* read only one byte (send a NACK) */
+	send_stop(); /* finish transaction */
+	if (stored&mask) { /* code already stored */
+		*channels = CHANNEL1;
+		return 0;
+	}
+	if (!(*channels&CHANNEL1)) { /* only codes authorized for channel 1 are saved (there is one bit per code) */
+		*channels = 0; /* the code is not authorized for any channel */
+		return 0;
+	}
+	/* save the code */
+	if (select_address(address)) {
+		return 2;
+	}
+	if (send_byte(stored|mask)) { /* set bit for this code */
+		send_stop();
+		return 2;
+	}
+	send_stop(); /* finish transaction, starting the write cycle */
+	if (poll_ack(0xa0)) { /* the byte has not been written in time */
+		return 2;
+	}
+	*channels = CHANNEL1;
+	return 1;
+}
+#else
+/* the header in the first page (big endian)
+ * 0-1: magic ('M','C')
+ * 2-3: generation (incremented on every clear)
+ * 4-5: number of codes
+ * 6-7: next free address (the codes are saved from the second page up to this high-water mark)
+ */
+#define MAGIC0 'M'
+#define MAGIC1 'C'
+static uint16_t generation = 0; /* how many times the memory has been cleared */
+static uint16_t count = 0; /* number of codes saved in EEPROM */
+static uint16_t next = PAGE; /* EEPROM address of the next free slot */
+/* the header is only rewritten when idle (see flush_codes), not after every page, to spare the header page */
+static uint8_t header_changed = 0; /* the values differ from the header in EEPROM */
+
+/* the pending codes not yet written in EEPROM
+ * they all are in the same page, following each other, starting at next
+ */
+static uint8_t pending[(PAGE/SLOT)*3];
+static uint8_t pending_channels[PAGE/SLOT]; /* the flags of the pending codes */
+static uint8_t pending_nb = 0; /* number of pending codes */
+/* the lookup of a code in EEPROM is done one page per call, so it does not hold the main loop while the log is long */
+static uint16_t lookup = 0; /* address of the next page to look in (0 if no lookup is ongoing) */
+
+/* write the header with the current values
+ * return 0 if the header is written, 1 on error (it is still changed)
+ */
+static uint8_t write_header(void)
+{
+	if (select_address(0x0000)) {
+		return 1;
+	}
+	if (send_byte(MAGIC0) || send_byte(MAGIC1) ||
+	    send_byte((uint8_t)(generation>>8)) || send_byte((uint8_t)(generation&0xff)) ||
+	    send_byte((uint8_t)(count>>8)) || send_byte((uint8_t)(count&0xff)) ||
+	    send_byte((uint8_t)(next>>8)) || send_byte((uint8_t)(next&0xff))) {
+		send_stop();
+		return 1;
+	}
+	send_stop(); /* finish transaction, starting the write cycle */
+	if (poll_ack(0xa0)) { /* the header has not been written in time */
+		return 1;
+	}
+	header_changed = 0;
+	return 0;
+}
+
+/* write the pending codes in their page (without updating the header)
+ * return 0 if the codes are written (or none is pending), 1 on error (the codes stay pending)
+ */
+static uint8_t write_page(void)
+{
+	uint8_t i;
+	if (pending_nb==0) { /* nothing to write */
+		return 0;
+	}
+	/* the pending codes are all in one page, so they can be written in one page write */
+	if (select_address(next)) {
+		return 1;
+	}
+	for (i=0; i<pending_nb*3; i++) {
+		if (send_byte(pending[i])) {
+			send_stop();
+			return 1;
+		}
+		if ((i%3)==2 && send_byte(pending_channels[i/3])) { /* flags */
+			send_stop();
+			return 1;
+		}
+	}
+	send_stop(); /* finish transaction, starting the write cycle */
+	if (poll_ack(0xa0)) { /* the page has not been written in time */
+		return 1;
+	}
+	next += pending_nb*SLOT;
+	count += pending_nb;
+	pending_nb = 0;
+	header_changed = 1;
+	return 0;
+}
+
+void init_store(void)
+{
+	uint8_t header[8];
+	/* read header */
+	if (start_read(0x0000)) {
+		return;
+	}
+	read_bytes(header, sizeof(header), 1); /* read header and send a NACK after the last byte */
+	send_stop(); /* finish transaction */
+	generation = ((uint16_t)header[2]<<8)|header[3];
+	count = ((uint16_t)header[4]<<8)|header[5];
+	next = ((uint16_t)header[6]<<8)|header[7];
+	if (header[0]==MAGIC0 && header[1]==MAGIC1 && next>=PAGE && next<=MEMORY && (next%SLOT)==0) { /* header is valid */
+		return;
+	}
+	/* no valid header, find the end of the codes once to recreate it */
+	generation = 0;
+	count = 0;
+	next = PAGE;
+	if (start_read(PAGE)) {
+		return;
+	}
+	while (next<MEMORY) {
+		if ((read_byte(1)&0x80)==0) { /* code always have the MSb to 1 */
+			break; /* free space found */
+		}
+		read_byte(1);
+		read_byte(1);
+		read_byte(1); /* flags */
+		next += SLOT;
+		count++;
+	}
+	read_byte(0); /* send a NACK to stop reading */
+	send_stop(); /* finish transaction */
+	header_changed = 1;
+	write_header(); /* else it is written on the next flush */
+}
+
+uint8_t save_code(uint8_t* code, uint8_t* channels)
+{
+	uint16_t address;
+	uint16_t end; /* end of the page to look in */
+	uint8_t stored[SLOT];
+	uint8_t i;
+	/* look in the codes in EEPROM (they end at the high-water mark), one page per call */
+	if (lookup==0) { /* start a new lookup */
+		lookup = PAGE;
+	}
+	if (lookup<next) {
+		end = lookup+PAGE;
+		if (end>next) {
+			end = next;
+		}
+		if (start_read(lookup)) {
+			lookup = 0;
+			return 2;
+		}
+		for (address=lookup; address<end; address+=SLOT) {
+			read_bytes(stored, SLOT, 0); /* read stored code and flags */
+			if (stored[0]==code[0] && stored[1]==code[1] && stored[2]==code[2]) { /* code already stored */
+				break;
+			}
+		}
+		read_byte(0); /* send a NACK to stop reading */
+		send_stop(); /* finish transaction */
+		if (address>=end) { /* not in this page */
+			lookup = end;
+			if (lookup<next) { /* continue with the next page on the next call */
+				return 4;
+			}
+		} else { /* code already stored */
+			lookup = 0;
+			if ((stored[3]|*channels)==stored[3]) { /* no new channel */
+				*channels = stored[3];
+				return 0;
+			}
+			/* add the channels to the flags of this code */
+			*channels |= stored[3];
+			if (select_address(address+3)) {
+				return 2;
+			}
+			if (send_byte(*channels)) {
+				send_stop();
+				return 2;
+			}
+			send_stop(); /* finish transaction, starting the write cycle */
+			if (poll_ack(0xa0)) { /* the flags have not been written in time */
+				return 2;
+			}
+			return 1;
+		}
+	}
+	lookup = 0; /* the code is not in EEPROM */
+	/* look in the codes not yet written */
+	for (i=0; i<pending_nb; i++) {
+		if (pending[i*3]==code[0] && pending[i*3+1]==code[1] && pending[i*3+2]==code[2]) { /* code already pending */
+			if ((pending_channels[i]|*channels)==pending_channels[i]) { /* no new channel */
+				*channels = pending_channels[i];
+				return 0;
+			}
+			pending_channels[i] |= *channels; /* will be written with the code */
+			*channels = pending_channels[i];
+			return 1;
+		}
+	}
+	address = next+pending_nb*SLOT; /* where the new code will be saved */
+	if (address>=MEMORY) { /* memory full */
+		return 3;
+	}
+	if (pending_nb>0 && (address%PAGE)==0) { /* new code is in the next page (the current page could not be written when it got full) */
+		if (write_page()) { /* could not write the page */
+			return 2;
+		}
+	}
+	/* add code to pending codes */
+	pending[pending_nb*3+0] = code[0];
+	pending[pending_nb*3+1] = code[1];
+	pending[pending_nb*3+2] = code[2];
+	pending_channels[pending_nb] = *channels;
+	pending_nb++;
+	if ((address%PAGE)==PAGE-SLOT) { /* page is full, write it (on error the codes stay pending, and are written on the next flush) */
+		write_page();
+	}
+	return 1;
+}
+
+void flush_codes(void)
+{
+	if (write_page()) { /* the codes stay pending */
+		return;
+	}
+	if (header_changed) { /* once per idle period at most, not after every page */
+		write_header();
+	}
+}
+#endif
+
+/* the region left to clear */
+static uint16_t clear_address = 0; /* next page to clear */
+static uint16_t clear_end = 0; /* end of the region to clear */
+
+void clear_memory(void)
+{
+#if defined(STORE_LOG)
+	/* reset the header first, so the old codes are ignored even if the clear is interrupted */
+	clear_end = next+pending_nb*SLOT; /* high-water mark */
+	pending_nb = 0; /* forget the codes not yet written */
+	lookup = 0; /* the codes looked in are gone */
+	generation++;
+	count = 0;
+	next = PAGE;
+	header_changed = 1;
+	write_header(); /* else it is written before clearing the first page */
+	clear_address = PAGE; /* only clear the used region */
+#else
+	/* codes are anywhere in memory */
+	clear_end = MEMORY;
+	clear_address = 0;
+#endif
+}
+
+uint8_t clear_next(void)
+{
+	uint8_t i;
+	if (clear_address>=clear_end) { /* nothing to clear */
+		return 0;
+	}
+#if defined(STORE_LOG)
+	if (header_changed && write_header()) { /* the old codes must be ignored before they are erased */
+		return 1; /* try again later */
+	}
+#endif
+	if (select_address(clear_address)) {
+		return 1; /* try again later */
+	}
+	for (i=0; i<PAGE; i++) {
+		if (send_byte(0x00)) { /* clear byte */
+			send_stop();
+			return 1; /* try again later */
+		}
+	}
+	send_stop(); /* finish transaction */
+	if (poll_ack(0xa0)) { /* the page has not been cleared in time */
+		return 1; /* try again later */
+	}
+	clear_address += PAGE;
+	return clear_address<clear_end;
+}
+
+/* the region left to dump */
+static uint16_t dump_address = 0; /* next address to read */
+static uint16_t dump_end = 0; /* end of the region to read */
+
+void dump_codes(void)
+{
+	dump_address = 0; /* start at begining of the memory (including the header) */
+#if defined(STORE_LINEAR)
+	dump_end = MEMORY; /* every byte can hold codes, go through the whole memory */
+#else
+	dump_end = next; /* go through the codes, up to the high-water mark */
+#endif
+}
+
+uint8_t dump_next(void)
+{
+	uint8_t i;
+	if (dump_address>=dump_end) { /* nothing to read */
+		return 0;
+	}
+	if (start_read(dump_address)) {
+		return 1; /* try again later */
+	}
+	for (i=1; i<PAGE && dump_address+i<dump_end; i++) { /* read up to one page */
+		read_byte(1);
+	}
+	read_byte(0); /* read last byte and send nack */
+	send_stop(); /* end transaction */
+	dump_address += i;
+	return dump_address<dump_end;
+}
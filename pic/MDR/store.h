@@ -0,0 +1,65 @@
+/* storage of the received codes in the external 24LC256 I2C EEPROM
+ * the storage mode is selected at compile time (STORE in the Makefile):
+ * - STORE_LOG: the codes are saved one behind each other, starting at the second page
+ *   the first page is a header with the number of codes, the end of the codes (high-water mark), and a generation counter
+ *   this way the end of the codes is known at boot without reading them, and a clear only erases the used region
+ *   each code uses a 4 bytes slot (3 bytes code, 1 byte flags), so a page holds exactly 16 codes and no code crosses a page
+ *   the flags are the channels the code is authorized for (0 if the code is only logged)
+ *   to find a code the memory has to be read until the code or a free space is found
+ *   new codes are first kept in RAM and written together in one page write (call flush_codes when idle)
+ *   the header is only rewritten by flush_codes, so the codes written while busy are only known at boot once the receiver has been idle
+ * - STORE_LINEAR: the original Linear scheme
+ *   the code is used as address: if the code 0xABCDEF is authorized, bit F/2 of the byte at address 0x(B&7)ECD is set
+ *   a lookup is only one random read, independently of how many codes are saved
+ *   only authorized codes are saved, and only for channel 1: there is no room for the channel, so a learn for channel 2 only is rejected (the code is not saved)
+ */
+#include <stdint.h>
+
+/* 24LC256 EEPROM geometry */
+#define MEMORY 0x8000 /* memory size, in bytes */
+#define PAGE 64 /* page size, in bytes (a write can not cross a page) */
+#define SLOT 4 /* space used per code in log mode, in bytes */
+
+#if !defined(STORE_LOG) && !defined(STORE_LINEAR)
+#define STORE_LOG /* default storage mode */
+#endif
+
+/* the channels a code can be authorized for (flags) */
+#define CHANNEL1 0x01 /* relay 1 */
+#define CHANNEL2 0x02 /* relay 2 (only MDR-2) */
+
+/* look in the memory for the code (3 bytes)
+ * if not present, save it with the channels to authorize it for (0 to only log it)
+ * if present, add the channels to the ones it is authorized for
+ * on return channels is set to all the channels the code is authorized for
+ * return 0 if the code is already in EEPROM (and no channel has been added)
+ * return 1 if the code is new or has new channels, and is saved
+ * return 2 if error occured
+ * return 3 if no space in memory
+ * return 4 if the lookup is not finished (in log mode one page is read per call), call again with the same code
+ */
+uint8_t save_code(uint8_t* code, uint8_t* channels);
+#if defined(STORE_LOG)
+/* read the header to know where the codes are (call once at boot) */
+void init_store(void);
+/* write the new codes kept in RAM to the EEPROM, and the header if it changed
+ * on error the codes stay in RAM, and are written on the next call
+ */
+void flush_codes(void);
+#else
+#define init_store() /* there is no header */
+#define flush_codes() /* codes are directly written */
+#endif
+/* the long operations are done step by step, so they can be interleaved with other tasks */
+/* start removing all codes from memory (the pages are erased using clear_next) */
+void clear_memory(void);
+/* erase the next page to clear
+ * return 1 if there are more pages to clear
+ */
+uint8_t clear_next(void);
+/* start reading all codes from memory, so a logic analyzer can get them (the pages are read using dump_next) */
+void dump_codes(void);
+/* read the next page to dump
+ * return 1 if there are more pages to read
+ */
+uint8_t dump_next(void);
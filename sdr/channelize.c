@@ -0,0 +1,148 @@
+/* wideband channelizer for the MegaCode SDR decoder
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* critically sampled polyphase analysis filterbank
+ * channel k is the signal shifted down by k*rate/M, low pass filtered, and decimated by M:
+ *   y_k[n] = sum_l h[l] x[nM-l] e^(j2πkl/M)
+ * splitting the filter in M branches (l = p+qM) gives u[p] = sum_q h[p+qM] x[nM-p-qM], and y_k[n] = sum_p u[p] e^(j2πkp/M)
+ * the branches u are computed once for all channels (this is the costly part, at the input rate)
+ * each channel is then one bin of the M points DFT of the branches, only the bins in the band of interest are computed
+ */
+/* libraries */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include "megacode.h"
+
+struct megacode_channelizer {
+	unsigned int channels; /* number of channels (M), also the decimation */
+	unsigned int length; /* prototype filter length (M*taps) */
+	float* filter; /* prototype low pass filter, with the gain to scale the envelope to 16 bits */
+	float* window; /* the last input samples (I,Q), newest first, twice to always have them contiguous */
+	unsigned int position; /* position of the newest sample in the window */
+	unsigned int phase; /* number of samples received since the last output */
+};
+
+struct megacode_channelizer* megacode_channelizer_new(unsigned int channels, unsigned int taps)
+{
+	struct megacode_channelizer* channelizer;
+	unsigned int i;
+	double x, w;
+	double sum = 0;
+	if (channels==0 || taps==0) {
+		return NULL;
+	}
+	channelizer = calloc(1, sizeof(struct megacode_channelizer));
+	if (!channelizer) {
+		return NULL;
+	}
+	channelizer->channels = channels;
+	channelizer->length = channels*taps;
+	channelizer->filter = malloc(channelizer->length*sizeof(float));
+	channelizer->window = calloc(channelizer->length*2*2, sizeof(float));
+	if (!channelizer->filter || !channelizer->window) {
+		megacode_channelizer_free(channelizer);
+		return NULL;
+	}
+	/* windowed sinc, cut at half the channel spacing, with a Blackman window */
+	for (i=0; i<channelizer->length; i++) {
+		x = (i-(channelizer->length-1)/2.0)/channels;
+		w = 0.42-0.5*cos(2*M_PI*i/(channelizer->length-1))+0.08*cos(4*M_PI*i/(channelizer->length-1));
+		channelizer->filter[i] = (x==0 ? 1 : sin(M_PI*x)/(M_PI*x))*w;
+		sum += channelizer->filter[i];
+	}
+	/* unity gain, and scale the envelope (at most 128*√2 for uint8 IQ) to 16 bits */
+	for (i=0; i<channelizer->length; i++) {
+		channelizer->filter[i] *= 256/sum;
+	}
+	channelizer->position = 0;
+	channelizer->phase = 0;
+	return channelizer;
+}
+
+void megacode_channelizer_free(struct megacode_channelizer* channelizer)
+{
+	if (channelizer) {
+		free(channelizer->filter);
+		free(channelizer->window);
+		free(channelizer);
+	}
+}
+
+size_t megacode_channelize(struct megacode_channelizer* channelizer, const uint8_t* iq, size_t length, float* branches)
+{
+	const unsigned int m = channelizer->channels;
+	const unsigned int l = channelizer->length;
+	size_t frames = 0; /* number of outputs */
+	size_t i;
+	unsigned int p, j;
+	float* window;
+	float* u;
+	for (i=0; i<length; i++) {
+		/* save the sample (newest first), twice */
+		channelizer->position = (channelizer->position ? channelizer->position : l)-1;
+		window = channelizer->window+channelizer->position*2;
+		window[0] = window[l*2] = iq[i*2]-127.5f;
+		window[1] = window[l*2+1] = iq[i*2+1]-127.5f;
+		if (++channelizer->phase<m) {
+			continue;
+		}
+		channelizer->phase = 0;
+		/* fold the filtered window in the branches */
+		u = branches+frames*m*2;
+		for (p=0; p<m*2; p++) {
+			u[p] = 0;
+		}
+		for (j=0; j<l; j+=m) { /* one tap of every branch at a time, this is vectorized */
+			for (p=0; p<m; p++) {
+				u[p*2] += channelizer->filter[j+p]*window[(j+p)*2];
+				u[p*2+1] += channelizer->filter[j+p]*window[(j+p)*2+1];
+			}
+		}
+		frames++;
+	}
+	return frames;
+}
+
+void megacode_channel(const float* branches, size_t frames, unsigned int channels, int channel, int16_t* samples)
+{
+	float cosines[channels], sines[channels];
+	unsigned int p, k;
+	size_t n;
+	float re, im, magnitude;
+	const float* u;
+	k = (unsigned int)((channel%(int)channels+(int)channels)%(int)channels);
+	for (p=0; p<channels; p++) {
+		cosines[p] = cos(2*M_PI*((k*p)%channels)/channels);
+		sines[p] = sin(2*M_PI*((k*p)%channels)/channels);
+	}
+	for (n=0; n<frames; n++) {
+		u = branches+n*channels*2;
+		re = 0;
+		im = 0;
+		for (p=0; p<channels; p++) {
+			re += u[p*2]*cosines[p]-u[p*2+1]*sines[p];
+			im += u[p*2]*sines[p]+u[p*2+1]*cosines[p];
+		}
+		magnitude = sqrtf(re*re+im*im);
+		if (magnitude>0xffff) {
+			magnitude = 0xffff;
+		}
+		samples[n] = (int16_t)(uint16_t)magnitude; /* the unsigned envelope wraps like the rtl_fm output */
+	}
+}
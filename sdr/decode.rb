@@ -3,143 +3,1196 @@
 # ruby: 2.1
 =begin
 this script will open a AM raw audio file gerenate by rtl_fm and decode the megacode message from it
+use '-' as file to decode the rtl_fm output live from the standard input:
+  rtl_fm -f 317.962M -M am - | ./decode.rb -
+the samples are processed as they come in (in blocks), so memory does not grow with the capture length
+in this streaming mode every value is printed as soon as it has been decoded
+the edges are detected using the native library if it has been compiled (run make), else in ruby
+use -a (before the file) to use an adaptive threshold instead of the fixed one, for weak or saturated captures
+the signal to noise ratio of every transmission is then also reported
+use -w to decode a raw IQ recording from rtl_sdr (2.4MS/s, unsigned 8 bits I and Q) instead of the rtl_fm output:
+  rtl_sdr -f 318M -s 2.4M - | ./decode.rb -w -
+the band is split in 24kHz channels, and all channels within +/- 120kHz are decoded at once (with the adaptive threshold)
+this requires the native library, the envelope and edges of every channel are computed in parallel (a worker thread per channel)
+use -i to decode a raw IQ recording at the tuned frequency only, like rtl_fm but without the intermediate 16 bits samples:
+  rtl_sdr -f 317.962M -s 2.4M - | ./decode.rb -i -
+the DC offset removal, decimation, AM demodulation, and adaptive threshold are done in one pass (this requires the native library)
+use -c to also combine the frames repeated while a button is pressed into one code per press, with a confidence
+this recovers codes when no frame can be decoded on its own (missing, additional or misplaced pulses)
+use -b to report the button presses instead of every frame: the frames repeated while a button is pressed are folded in one press, with its start and end, number of frames, and best signal to noise ratio
+the remotes pressed at the same time are tracked separately, and a press is reported once its frame did not repeat for 0.5s
+provide several files or directories (all *.pcm files in it, *.iq with -i or -w) to decode them in batch:
+  ./decode.rb samples
+the files are decoded in parallel (one process per core), the report of every file is printed in order, followed by the totals and throughput
+use -r to only decode a time range of the files, without reading the rest ([[hh:]mm:]ss, the end is optional):
+  ./decode.rb -r 02:00-02:15 capture.pcm
+the files are memory mapped, and the native library processes the samples in place, so memory use does not depend on the file size
+the sample rate of the files is detected from the pulse timings (24kHz for the standard input), use --rate to set it (the IQ sample rate with -i):
+  rtl_fm -f 317.962M -M am -s 48k - | ./decode.rb --rate 48k -
+use -s to also publish the values and codes as binary events to a shared memory ring (this requires the native library), and/or -u to a unix socket:
+  rtl_fm -f 317.962M -M am - | ./decode.rb -s /megacode -u /tmp/megacode.sock -
+  ./events.rb /megacode
+use -e to also append the values to an event store (a directory, see store.rb to query it):
+  ./decode.rb -e events capture.pcm
 =end
+require 'fiddle'
+require 'etc'
+require 'thread'
+require 'stringio'
+require 'socket'
+require_relative 'store'
 
 # constants
 RATE = 24000 # the output sample rate, in Hz
+IQ_RATE = 2400000 # the raw IQ sample rate (rtl_sdr output), in Hz
 # the expected samples are little endian signed 16 bits intergers
 THRESHOLD = ((2**16)/2)*0.5
 TOLERANCE = 1.10 # how much deviation to accept
+BLOCK = 4096 # how many samples to read from a file at once
+STREAM_BLOCK = 48 # how many samples to read at most from the standard input at once (2ms at 24kHz)
 
-raise "provide raw AM file to decode as argument" unless ARGV[0] and File.exist? ARGV[0] and File.file? ARGV[0]
+# size of the raw samples in bytes, either a string or a pointer to the mapped file (see MappedFile, only for the native library)
+def raw_size(raw)
+  raw.is_a?(Fiddle::Pointer) ? raw.size : raw.bytesize
+end
+
+# read a capture file using mmap, so the native library processes the samples in place without copying them in ruby strings
+# the file is mapped one window at a time (with sequential access hints), so memory use does not depend on the file size
+class MappedFile
+  WINDOW = 16*1024*1024 # size of the mapped windows, in bytes (a multiple of the page size)
+  PROT_READ = 1 # mmap protection (Linux value)
+  MAP_PRIVATE = 2 # mmap flags (Linux value)
+  MADV_SEQUENTIAL = 2 # madvise advice: read ahead, and free the pages soon after they are read (Linux value)
+  MAP_FAILED = 2**(Fiddle::SIZEOF_VOIDP*8)-1 # (void*)-1
+
+  def initialize(file)
+    @file = file
+    libc = Fiddle.dlopen(nil)
+    @mmap = Fiddle::Function.new(libc["mmap"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T, Fiddle::TYPE_INT, Fiddle::TYPE_INT, Fiddle::TYPE_INT, Fiddle::TYPE_LONG], Fiddle::TYPE_VOIDP)
+    @madvise = Fiddle::Function.new(libc["madvise"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T, Fiddle::TYPE_INT], Fiddle::TYPE_INT)
+    @munmap = Fiddle::Function.new(libc["munmap"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T], Fiddle::TYPE_INT)
+  end
+
+  # yield pointers to the blocks of at most size bytes from offset to stop (in bytes)
+  def each_block(offset, stop, size)
+    position = offset
+    while position<stop do
+      start = position-position%WINDOW
+      length = [WINDOW, stop-start].min
+      window = @mmap.call(nil, length, PROT_READ, MAP_PRIVATE, @file.fileno, start)
+      raise "could not map #{@file.path}" if window.to_i==MAP_FAILED
+      begin
+        @madvise.call(window, length, MADV_SEQUENTIAL)
+        while position<start+length do
+          block = [size, start+length-position].min
+          yield Fiddle::Pointer.new(window.to_i+position-start, block)
+          position += block
+        end
+      ensure
+        @munmap.call(window, length)
+      end
+    end
+  end
+end
+
+# detect the threshold crossings in the raw samples, in ruby
+# the sample index (relative to the block) and if it is a rising edge is yielded for every edge
+# the adaptive detectors also yield its level: the noise floor before the pulse for a rising edge, the highest level of the pulse for a falling edge
+# every detector returns the number of samples in the block
+class EdgeDetector
+  def initialize
+    @on = false # has the threshold been crossed
+  end
+
+  def detect(raw)
+    raw.unpack("s<*").each_with_index do |sample,index| # get samples (little endian signed 16 bits intergers)
+      if !@on then # detect when threshold is crossed
+        if sample > THRESHOLD then
+          @on = true
+          yield index, true
+        end
+      else
+        if sample < THRESHOLD then
+          @on = false
+          yield index, false
+        end
+      end
+    end
+    raw.bytesize/2
+  end
+end
+
+# detect the edges using an adaptive threshold, in ruby (see edges.c for the explanation, the result is the same)
+# the levels are the unwrapped samples << 8
+class AdaptiveEdgeDetector
+  AGC_FLOOR = 1024<<8 # minimum threshold, to ignore a silent input
+  AGC_DEVIATION = 14 # minimum distance between the threshold and the noise floor, in noise deviations
+  AGC_NOISE = 6 # noise floor and deviation averaging (1/2^n of the new sample, at 24kHz)
+  AGC_DECAY = 16 # peak decay (1/2^n of the distance to the noise floor per sample, at 24kHz)
+
+  # log2 of the sample rate / 24kHz, the averaging and decay are this much slower at higher rates
+  def self.shift(rate)
+    [[Math.log2(rate.to_f/RATE).round, -4].max, 8].min
+  end
+
+  # rate: the sample rate, in Hz
+  def initialize(rate = RATE)
+    @shift = AdaptiveEdgeDetector.shift(rate)
+    @noise = -1 # noise floor (negative until the first sample)
+    @deviation = 0 # mean deviation of the noise from the noise floor
+    @peak = 0 # peak level of the recent pulses
+    @top = 0 # highest level of the current pulse
+    @on = false # is the signal on
+  end
+
+  # the edges are yielded after the whole block has been processed, like with the native library
+  def detect(raw)
+    edges = []
+    raw.unpack("s<*").each_with_index do |sample,index|
+      magnitude = (sample<0 ? sample+0x10000 : sample)<<8 # unwrap the overflowed samples
+      if @noise<0 then # first sample
+        @noise = magnitude
+        @deviation = 0
+        @peak = magnitude
+      end
+      span = @peak-@noise
+      if @on then # falling below the middle minus hysteresis
+        if magnitude>@peak then
+          @peak = magnitude
+          span = @peak-@noise
+        end
+        @top = magnitude if magnitude>@top
+        if magnitude<@noise+(span>>1)-(span>>3) then
+          @on = false
+          edges << [index, false, @top]
+        end
+      else # rising above the middle plus hysteresis, and clearly above the noise
+        threshold = [@noise+(span>>1)+(span>>3), @noise+@deviation*AGC_DEVIATION, AGC_FLOOR].max
+        if magnitude>threshold then
+          @on = true
+          @peak = magnitude if magnitude>@peak
+          @top = magnitude
+          edges << [index, true, @noise]
+        else
+          @deviation += ((magnitude-@noise).abs-@deviation)>>(AGC_NOISE+@shift)
+          @noise += (magnitude-@noise)>>(AGC_NOISE+@shift)
+        end
+      end
+      @peak -= (@peak-@noise)>>(AGC_DECAY+@shift)
+    end
+    edges.each do |index, rising, level|
+      yield index, rising, level
+    end
+    raw.bytesize/2
+  end
+end
+
+# detect the threshold crossings using the native library (see edges.c), several samples at a time
+class NativeEdgeDetector
+  LIBRARY = File.join(File.dirname(File.expand_path(__FILE__)), "libmegacode.so")
 
-raw = IO.binread ARGV[0] # read raw file
-samples = raw.unpack "s<*" # get samples (little endian signed 16 bits intergers)
+  def self.available?
+    File.exist? LIBRARY
+  end
 
-# detect falling edges, after crossing the threshold
-on = false # has the threshold been crossed
-edges = []
-samples.each_index do |i|
-  sample = samples[i]
-  if !on then # detect when threshold is crossed
-    if sample > THRESHOLD then
-      on = true
-      edges << {:sample => i, :rising => true}
+  # use the adaptive threshold (megacode_edges_agc) instead of the fixed one, for the sample rate (in Hz)
+  def initialize(adaptive = false, rate = RATE)
+    library = Fiddle.dlopen(LIBRARY)
+    @adaptive = adaptive
+    if @adaptive then
+      @edges = Fiddle::Function.new(library["megacode_edges_agc"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP], Fiddle::TYPE_SIZE_T)
+      @state = Fiddle::Pointer.malloc(6*4, Fiddle::RUBY_FREE) # struct megacode_agc
+      @state[0, 6*4] = [-1, 0, 0, 0, AdaptiveEdgeDetector.shift(rate), 0].pack("l6")
+    else
+      @edges = Fiddle::Function.new(library["megacode_edges"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T, Fiddle::TYPE_SHORT, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP], Fiddle::TYPE_SIZE_T)
+      @state = Fiddle::Pointer.malloc(1, Fiddle::RUBY_FREE) # the level between the blocks
+      @state[0] = 0
+    end
+    @buffer = nil # where the edges are saved (as much as samples)
+    @levels = nil # where the levels of the edges are saved (adaptive threshold only)
+    @size = 0
+  end
+
+  def detect(raw)
+    length = raw_size(raw)/2
+    if length>@size then
+      @size = length
+      @buffer = Fiddle::Pointer.malloc(@size*4, Fiddle::RUBY_FREE)
+      @levels = Fiddle::Pointer.malloc(@size*4, Fiddle::RUBY_FREE) if @adaptive
+    end
+    if @adaptive then
+      nb = @edges.call(raw, length, @state, @buffer, @levels)
+      @buffer[0, nb*4].unpack("L*").zip(@levels[0, nb*4].unpack("l*")).each do |edge, level| # sample index << 1 | rising
+        yield edge>>1, edge&1==1, level
+      end
+    else
+      nb = @edges.call(raw, length, THRESHOLD.to_i, @state, @buffer)
+      @buffer[0, nb*4].unpack("L*").each do |edge| # sample index << 1 | rising
+        yield edge>>1, edge&1==1
+      end
+    end
+    length
+  end
+end
+
+# detect the edges directly in the raw IQ samples (rtl_sdr output) using the native front end (see megacode_frontend_edges), instead of the rtl_fm output
+# the IQ samples are decimated to the decoder sample rate, and the AM envelope is detected with the adaptive threshold, in one pass
+class IQEdgeDetector
+  attr_reader :decimation # IQ samples per decoder sample
+
+  # rate: the IQ sample rate, it is decimated to about the decoder sample rate
+  def initialize(rate = IQ_RATE)
+    library = Fiddle.dlopen(NativeEdgeDetector::LIBRARY)
+    create = Fiddle::Function.new(library["megacode_frontend_new"], [-Fiddle::TYPE_INT], Fiddle::TYPE_VOIDP)
+    @decimation = [(rate.to_f/RATE).round, 1].max
+    @frontend = create.call(@decimation)
+    raise "could not create IQ front end" if @frontend.null?
+    @frontend.free = library["megacode_frontend_free"]
+    @edges = Fiddle::Function.new(library["megacode_frontend_edges"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP], Fiddle::TYPE_SIZE_T)
+    @state = Fiddle::Pointer.malloc(6*4, Fiddle::RUBY_FREE) # struct megacode_agc (at the decoder sample rate)
+    @state[0, 6*4] = [-1, 0, 0, 0, 0, 0].pack("l6")
+    @samples = Fiddle::Pointer.malloc(Fiddle::SIZEOF_SIZE_T, Fiddle::RUBY_FREE) # number of output samples
+    @buffer = nil # where the edges are saved (as much as output samples)
+    @levels = nil # where the levels of the edges are saved
+    @size = 0
+  end
+
+  # the block are interleaved unsigned 8 bits I and Q, the returned number of samples is after decimation
+  def detect(raw)
+    length = raw_size(raw)/2
+    if length/@decimation+1>@size then
+      @size = length/@decimation+1
+      @buffer = Fiddle::Pointer.malloc(@size*4, Fiddle::RUBY_FREE)
+      @levels = Fiddle::Pointer.malloc(@size*4, Fiddle::RUBY_FREE)
+    end
+    nb = @edges.call(@frontend, raw, length, @state, @buffer, @levels, @samples)
+    @buffer[0, nb*4].unpack("L*").zip(@levels[0, nb*4].unpack("l*")).each do |edge, level| # sample index << 1 | rising
+      yield edge>>1, edge&1==1, level
+    end
+    @samples[0, Fiddle::SIZEOF_SIZE_T].unpack("J")[0]
+  end
+end
+
+# split a raw IQ recording (rtl_sdr output) in channels, using the native library (see channelize.c)
+# every channel is decimated to the decoder sample rate, and its AM envelope is computed by its own worker thread
+# the native functions do not hold the GVL, so the envelopes (and the edges, see NativeEdgeDetector) of the channels are computed in parallel
+# the edges are then decoded in ruby, which holds the GVL, one channel at a time
+class Channelizer
+  CHANNELS = IQ_RATE/RATE # number of channels, the channel spacing is the decoder sample rate
+  TAPS = 32 # prototype filter taps per channel (the neighbour channels are attenuated by more than 60dB 2kHz past the channel edge)
+  BAND = 120000 # only the channels within this offset to the tuned frequency are decoded (the remotes are +/- 100kHz), in Hz
+  attr_reader :offsets # the offset of the decoded channels to the tuned frequency, in Hz
+
+  def initialize
+    library = Fiddle.dlopen(NativeEdgeDetector::LIBRARY)
+    create = Fiddle::Function.new(library["megacode_channelizer_new"], [-Fiddle::TYPE_INT, -Fiddle::TYPE_INT], Fiddle::TYPE_VOIDP)
+    @channelizer = create.call(CHANNELS, TAPS)
+    raise "could not create channelizer" if @channelizer.null?
+    @channelizer.free = library["megacode_channelizer_free"]
+    @channelize = Fiddle::Function.new(library["megacode_channelize"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T, Fiddle::TYPE_VOIDP], Fiddle::TYPE_SIZE_T)
+    @channel = Fiddle::Function.new(library["megacode_channel"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T, -Fiddle::TYPE_INT, Fiddle::TYPE_INT, Fiddle::TYPE_VOIDP], Fiddle::TYPE_VOID)
+    @indexes = (-(BAND*CHANNELS/IQ_RATE)..(BAND*CHANNELS/IQ_RATE)).to_a
+    @offsets = @indexes.collect { |index| index*IQ_RATE/CHANNELS }
+    @branches = nil # the polyphase filter outputs
+    @samples = [] # the channel envelopes
+    @size = 0 # number of outputs the buffers can hold
+    @workers = nil # the queue of every channel worker: the number of outputs to process and the block to call
+    @done = Queue.new # the workers report when they processed the block (nil, or the exception raised)
+  end
+
+  # filter the raw IQ samples (interleaved unsigned 8 bits I and Q)
+  # the block is called (in parallel, from the worker of every channel) with the index of every channel and its envelope (little endian signed 16 bits integers like the rtl_fm output, in a native buffer valid during the call)
+  # return once all channels have been processed
+  def split(raw, &block)
+    length = raw_size(raw)/2
+    if length/CHANNELS+1>@size then
+      @size = length/CHANNELS+1
+      @branches = Fiddle::Pointer.malloc(@size*CHANNELS*2*4, Fiddle::RUBY_FREE)
+      @samples = @indexes.collect { Fiddle::Pointer.malloc(@size*2, Fiddle::RUBY_FREE) }
+    end
+    frames = @channelize.call(@channelizer, raw, length, @branches)
+    return if frames==0
+    @workers ||= @indexes.each_index.collect do |i| # the workers are started once, and wait for the next block
+      queue = Queue.new
+      Thread.new do
+        loop do
+          outputs, callback = queue.pop
+          begin
+            @channel.call(@branches, outputs, CHANNELS, @indexes[i], @samples[i])
+            callback.call(i, Fiddle::Pointer.new(@samples[i].to_i, outputs*2))
+            @done << nil
+          rescue Exception => e
+            @done << e
+          end
+        end
+      end
+      queue
+    end
+    @workers.each { |queue| queue << [frames, block] }
+    errors = @workers.collect { @done.pop }.compact
+    raise errors[0] unless errors.empty?
+  end
+end
+
+# combine the frames repeated while a button is pressed, to get the code even if no frame can be decoded on its own
+# every pulse is placed in its bitframe, with a soft bit: the distance to the 0 or 1 position gives the confidence
+# (1 exactly on it, 0 at the tolerance), missing and additional pulses do not break the bitframe tracking
+# a frame starts with the sync bit, after 24 bitframes and a blank one (its length depends on the remote)
+# missing pulses leave a gap in the frame, but the next pulse still matches the bitframes
+# the frames of a burst are aligned, and their soft bits summed (soft vote), the sign gives the bit, and the magnitude the confidence
+# every frame is weighted by its quality (the mean confidence of its bitframes with a single pulse), so noise does not outvote clean frames
+# the times are sample indexes, the block is called with the value, the confidence (0-1), the number of frames, and the start and end of the burst for every burst of frames
+class Combiner
+  BURST = 100 # a burst ends when no pulse occured for this long, in ms
+  BLANK = 2*6*(1-(TOLERANCE-1)) # a blank bitframe occured when no pulse occured for this long, in ms
+  SLOTS = 25 # the frames repeat every 25 bitframes (24 bits and a blank one)
+
+  # rate: the sample rate, in Hz
+  def initialize(rate, &block)
+    @callback = block
+    @burst = (BURST*rate/1000.0).ceil # BURST in samples
+    @blank = (BLANK*rate/1000.0).ceil # BLANK in samples
+    @bitframe = (6*rate/1000.0).round # bitframe duration in samples
+    @zero = (2*rate/1000.0).round # position of the 0 pulse in the bitframe, in samples
+    @step = (3*rate/1000.0).round # distance between the 0 and 1 pulse positions, in samples
+    @one = @zero+@step # position of the 1 pulse in the bitframe, in samples
+    new_burst
+  end
+
+  # add the next pulse
+  def pulse(sample)
+    flush if @last and sample-@last>=@burst
+    if !@last then # the first pulse is the sync bit of the first frame
+      @first = sample
+      new_frame(sample)
+    else
+      # the pulse is after 2ms (0) or 5ms (1) in one of the next bitframes, find the closest position
+      distance = sample-@start-@zero # from the 0 position in the next bitframe
+      position = (2*distance.abs+@step)/(2*@step)*(distance<=>0) # the 0 and 1 positions alternate every 3ms (rounded half away from 0)
+      bit = position%2
+      slot = @slot+1+position.div(2)
+      confidence = [1-(distance-position*@step).abs*2.0/@step, 0].max # only the soft bit is not an integer
+      # after the blank bitframe, or after a gap not matching the bitframes (the frame got lost in noise), this is the sync bit of the next frame
+      if slot>24 or (sample-@last>=@blank and confidence<0.5) then
+        new_frame(sample)
+      elsif slot<24 then # else the pulse is in the blank bitframe, and is noise
+        @frame[slot] << (bit==1 ? confidence : -confidence)
+        if slot>@slot then # use the pulse to sync, else it is an additional pulse in the current bitframe
+          @slot = slot
+          @start = sample-(bit==1 ? @one : @zero)+@bitframe
+        end
+      end
+    end
+    @last = sample
+  end
+
+  # end the burst if no pulse occured for long enough
+  def idle(sample)
+    flush if @last and sample-@last>=@burst
+  end
+
+  # combine the frames of the burst
+  def flush
+    unless @frames.empty? then
+      # the soft bit and number of pulses per bitframe (with the blank one), and the quality of every frame
+      frames = @frames.collect do |frame|
+        weight = frame[1..-1].inject(0) { |total, softs| total+(softs.size==1 ? softs[0].abs : 0) }/23
+        [frame.collect { |softs| softs.inject(0, :+) }+[0], frame.collect(&:size)+[0], weight]
+      end
+      # align the frames on the best one (the cleanest frame started after a blank bitframe), and sum the weighted soft bits
+      # the frames repeat every 25 bitframes, thus a frame which did not start on the sync bit is rotated
+      reference = frames.max_by { |softs, nbs, weight| weight }[0]
+      sums = Array.new(SLOTS, 0.0)
+      pulses = Array.new(SLOTS, 0)
+      weights = 0.0
+      frames.each do |softs, nbs, weight|
+        shift = (0...SLOTS).max_by do |offset|
+          agreement = (0...SLOTS).inject(0) { |total, slot| total+reference[(slot+offset)%SLOTS]*softs[slot] }
+          [agreement, -[offset, SLOTS-offset].min]
+        end
+        weights += weight
+        SLOTS.times do |slot|
+          sums[(slot+shift)%SLOTS] += weight*softs[slot]
+          pulses[(slot+shift)%SLOTS] += nbs[slot]
+        end
+      end
+      sums = sums[0, 24] # drop the blank bitframe
+      pulses = pulses[0, 24]
+      # all bits need at least one pulse
+      if weights>0 and pulses[1..-1].all? { |nb| nb>0 } then
+        value = 1
+        sums[1..-1].each do |sum|
+          value = (value << 1) + (sum>0 ? 1 : 0)
+        end
+        confidence = sums[1..-1].inject(0) { |total, sum| total+sum.abs }/(23*weights)
+        @callback.call(value, confidence, @frames.size, @first, @last)
+      end
+    end
+    new_burst
+  end
+
+  private
+
+  def new_frame(sample)
+    @frame = Array.new(24) { [] } # the soft bits of every bitframe
+    @frame[0] << 1.0 # sync bit
+    @frames << @frame
+    @slot = 0 # the bitframe of the last pulse
+    @start = sample-@one+@bitframe # when the next bitframe starts
+  end
+
+  def new_burst
+    @frames = [] # the frames of the burst
+    @first = nil # sample of the first pulse
+    @last = nil # sample of the last pulse
+  end
+end
+
+# fold the frames of a button press into one press
+# a remote repeats its frame every 25 bitframes while the button is pressed, the press ends when its frame has not started again within GAP
+# the frames of several remotes pressed at the same time are tracked separately (by value)
+# the block is called with the value, number of frames, best signal to noise ratio (nil if unknown), start of the first frame and end of the last frame (its last pulse, in samples)
+class PressAggregator
+  GAP = 500 # a press ends when its frame did not start again for this long, in ms (this allows 2 missing frames)
+  FRAME = 26*6 # a frame is decoded at most this long after it started (24 bitframes and the blank), in ms
+
+  # rate: the sample rate, in Hz
+  def initialize(rate, &block)
+    @callback = block
+    @gap = (GAP*rate/1000.0).ceil # GAP in samples
+    @frame = (FRAME*rate/1000.0).ceil # FRAME in samples
+    @presses = {} # the current presses by value: [start of the first frame, start of the last frame, number of frames, best snr, end of the last frame]
+  end
+
+  # add a decoded frame (start and end, its last pulse, in samples)
+  def frame(value, start, stop, snr)
+    press = @presses[value]
+    if press and start-press[1]>=@gap then # this is a new press
+      report(value)
+      press = nil
+    end
+    if press then
+      press[1] = start
+      press[2] += 1
+      press[3] = snr if snr and (!press[3] or snr>press[3])
+      press[4] = stop
+    else
+      @presses[value] = [start, start, 1, snr, stop]
+    end
+  end
+
+  # end the presses which can not have a next frame anymore (sample is the current one)
+  def idle(sample)
+    @presses.select { |value, press| sample-press[1]>=@gap+@frame }.sort_by { |value, press| press[0] }.each { |value, press| report(value) }
+  end
+
+  # end all presses
+  def flush
+    @presses.sort_by { |value, press| press[0] }.each { |value, press| report(value) }
+  end
+
+  private
+
+  def report(value)
+    first, last, frames, snr, stop = @presses.delete(value)
+    @callback.call(value, frames, snr, first, stop)
+  end
+end
+
+# the decoder is a single state machine fed with samples
+# edge detection, pulse merging, grouping and bit slicing are all done incrementally
+# only the state of the current pulse and group is kept, not the whole capture
+# the times are sample indexes, and the timing thresholds are converted once to samples, so only integers are compared
+# the block is called for every event: :group (size), :error (transmission and pulse index), :value (decoded value, signal to noise ratio in dB if known, and start in ms)
+# the signal to noise ratio of a value is the highest level of its pulses over the noise floor before its first pulse (from the edge levels of the adaptive detectors)
+# when combining, it is also called with :code (combined value, confidence, number of frames, and start and end in ms) for every burst of frames
+# when aggregating the presses, it is also called with :press (value, number of frames, best signal to noise ratio, start of the first frame and end of the last frame in ms) for every button press
+class Decoder
+  attr_reader :edges, :pulses, :groups, :transmissions, :values, :codes, :presses, :rate
+
+  # adaptive: use an adaptive threshold instead of the fixed one
+  # combine: combine the frames of every burst (see Combiner)
+  # iq: the samples are raw IQ samples instead of the rtl_fm output (see IQEdgeDetector, always adaptive)
+  # rate: the sample rate of the input, in Hz (the IQ sample rate with iq)
+  # presses: aggregate the frames of every button press (see PressAggregator)
+  def initialize(adaptive = false, combine = false, iq = false, rate = RATE, presses = false, &block)
+    @callback = block
+    if iq then
+      @detector = IQEdgeDetector.new(rate)
+      @rate = rate.to_f/@detector.decimation # the sample rate after decimation
+    else
+      if NativeEdgeDetector.available? then
+        @detector = NativeEdgeDetector.new(adaptive, rate)
+      else
+        @detector = adaptive ? AdaptiveEdgeDetector.new(rate) : EdgeDetector.new
+      end
+      @rate = rate
+    end
+    # the timing thresholds in samples (for integers, x>t is x>floor(t), and x>=t is x>=ceil(t))
+    @pulse_length = (1*TOLERANCE*@rate/1000).floor # a pulse lasts at most 1ms
+    @blank = (2*6*(1-(TOLERANCE-1))*@rate/1000).ceil # no pulse for 2 bitframes ends the group
+    @bitframe = (6*@rate/1000.0).round # bitframe duration
+    @one = (3*@rate/1000.0).round # distance between the 0 (after 2ms) and 1 (after 5ms) pulse positions
+    @window = (1.5*@rate/1000).floor # the pulses can be this far from their expected position
+    @codes = 0 # number of combined values
+    if combine then
+      @combiner = Combiner.new(@rate) do |value, confidence, frames, start, stop|
+        @codes += 1
+        @callback.call(:code, value, confidence, frames, ms(start), ms(stop))
+      end
+    end
+    @presses = 0 # number of button presses
+    if presses then
+      @aggregator = PressAggregator.new(@rate) do |value, frames, snr, start, stop|
+        @presses += 1
+        @callback.call(:press, value, frames, snr, ms(start), ms(stop))
+      end
+    end
+    @edges = 0 # number of detected edges
+    @pulses = 0 # number of detected pulses
+    @groups = 0 # number of detected pulse groups
+    @transmissions = 0 # number of groups with 24 pulses
+    @values = 0 # number of decoded values
+    @sample = 0 # index of the next sample
+    @on = false # is the signal above the threshold
+    @pulse_begin = nil # first rising edge of the current pulse
+    @pulse_end = nil # last falling edge of the current pulse
+    @pulse_noise = nil # noise floor before the current pulse (if known)
+    @pulse_top = nil # highest level of the current pulse (if known)
+    new_group
+  end
+
+  # process the next raw samples (little endian signed 16 bits intergers, or IQ samples)
+  def feed(raw)
+    process(*detect(raw))
+  end
+
+  # detect edges in the next raw samples, after crossing the threshold
+  # return the edges (sample index relative to the block << 1 | rising), the number of samples, and the levels of the edges (nil if unknown), for process
+  def detect(raw)
+    edges = []
+    levels = []
+    samples = @detector.detect(raw) do |index, rising, level|
+      edges << ((index<<1)|(rising ? 1 : 0))
+      levels << level
+    end
+    return edges, samples, levels
+  end
+
+  # process the edges of the next samples (see detect)
+  def process(edges, samples, levels)
+    edges.each_with_index do |edge, i|
+      @on = (edge&1==1)
+      edge(@sample+(edge>>1), @on, levels[i])
+    end
+    @sample += samples
+    # a pulse is complete once the signal is low 1ms after it started (the next edge can only be the rising edge of the next pulse)
+    if @pulse_begin and @pulse_end and !@on and @sample-@pulse_begin>@pulse_length then
+      pulse(@pulse_begin)
+      @pulse_begin = nil
+      @pulse_end = nil
     end
+    # the group is complete once no pulse occured within 2 bitframes (the blank bitframe has been seen)
+    if @group_size>0 and @sample-@group_last>=@blank and (!@pulse_begin or @pulse_begin-@group_last>=@blank) then
+      end_group
+    end
+    @combiner.idle(@sample) if @combiner
+    @aggregator.idle(@sample) if @aggregator
+  end
+
+  # end of the samples, flush what is left
+  def finish
+    # add last pulse
+    pulse(@pulse_begin) if @pulse_begin and @pulse_end
+    @pulse_begin = nil
+    @pulse_end = nil
+    # add last group
+    end_group if @group_size>0
+    @combiner.flush if @combiner
+    @aggregator.flush if @aggregator
+  end
+
+  private
+
+  # convert a sample index to milliseconds (for the events)
+  def ms(sample)
+    sample*1000.0/@rate
+  end
+
+  # the bursts (HF activity) should last 1ms
+  # verify if this is true, and ignore oscilastion within this 1ms
+  # level is the noise floor for a rising edge, and the highest level since the rising edge for a falling edge (nil if unknown)
+  def edge(sample, rising, level)
+    @edges += 1
+    # search first pulse (rising edge)
+    unless @pulse_begin then
+      return unless rising
+      @pulse_begin = sample
+      @pulse_noise = level
+      @pulse_top = nil
+    end
+    # detect pulses: falling and rising edge within 1ms
+    # ignore edges within this 1ms
+    if !rising then
+      @pulse_top = level if level and (!@pulse_top or level>@pulse_top)
+      @pulse_end ||= sample
+      if @pulse_end-@pulse_begin<=@pulse_length then
+        @pulse_end = sample
+      else # this is too long for a pulse. discard it
+        @pulse_begin = nil
+      end
+    else # rising edge
+      if sample-@pulse_begin>@pulse_length then # this is the beginning of the next pulse
+        raise "two rising egdes without falling edge detected" unless @pulse_end # this should not happen
+        pulse(@pulse_begin)
+        @pulse_begin = sample
+        @pulse_end = nil
+        @pulse_noise = level
+        @pulse_top = nil
+      end # ignore rising egdes within a pulse
+    end
+  end
+
+  # split pulses into groups
+  # one group has 24 pulses with a bitframe of 6ms
+  # a blank bitframe without pulse separates groups
+  # we will split groups when no pulse occured within after 2 bitframes
+  def pulse(sample)
+    @pulses += 1
+    @combiner.pulse(sample) if @combiner
+    end_group if @group_size>0 and (sample-@group_last)>=@blank
+    # verify that there is exactly one pulse per 6ms bitframe
+    # the pulse is either after 2 ms or 5 ms
+    if @group_size<24 and !@error then
+      # use the previous pulse to sync
+      @sync = sample-@one if @group_size==0 # the first pulse is always in the second halt (after 5 ms)
+      # the next pulse is after 6 or 9 ms
+      offset = sample-@sync
+      if offset>-@window and offset<=@window then
+        @value = (@value << 1) + 0
+        @sync = sample+@bitframe
+      elsif offset>@one-@window and offset<=@one+@window then
+        @value = (@value << 1) + 1
+        @sync = sample-@one+@bitframe
+      else
+        @error = @group_size # remember which pulse could not be decoded
+      end
+    end
+    if @group_size==0 then
+      @group_first = sample
+      @group_noise = @pulse_noise
+    end
+    @group_peak = @pulse_top if @pulse_top and (!@group_peak or @pulse_top>@group_peak)
+    @group_size += 1
+    @group_last = sample
+    transmission if @group_size==24 and !@error # the frame is reported as soon as its last pulse is complete, without waiting for the blank bitframe
+  end
+
+  # transmissions have 24 pulses
+  # the pulses following the 24th before a blank bitframe make the group too long, they are not decoded
+  def transmission
+    @values += 1
+    snr = (@group_noise and @group_peak and @group_noise>0 and @group_peak>@group_noise) ? 20*Math.log10(@group_peak.to_f/@group_noise) : nil
+    @callback.call(:value, @value, snr, ms(@group_first))
+    @aggregator.frame(@value, @group_first, @group_last, snr) if @aggregator
+    @transmissions += 1
+  end
+
+  # no pulse within 2 bitframes, the next pulse starts a new group
+  # the groups of 24 pulses which could not be decoded are only reported once complete (they could be longer noise)
+  def end_group
+    @groups += 1
+    @callback.call(:group, @group_size)
+    if @group_size==24 and @error then
+      @callback.call(:error, @transmissions, @error)
+      @transmissions += 1
+    end
+    new_group
+  end
+
+  def new_group
+    @group_size = 0 # number of pulses in the group
+    @group_first = nil # sample of the first pulse in the group
+    @group_last = nil # sample of the last pulse in the group
+    @group_noise = nil # noise floor before the first pulse of the group (if known)
+    @group_peak = nil # highest level of the pulses in the group (if known)
+    @sync = nil # sample when the next 0 pulse is expected
+    @value = 0 # the bits decoded so far
+    @error = nil # index of the first pulse which could not be decoded
+  end
+end
+
+
+# publish the decoded values and codes to the local consumers as fixed size binary events (see struct megacode_event)
+# the socket clients which can not keep up are disconnected (instead of holding back the decoder)
+class Publisher
+  EVENT = "Q<q<q<L<S<CCel<S<CCL<" # struct megacode_event
+  EVENT_SIZE = 48
+  KINDS = {value: 0, code: 1, press: 2} # MEGACODE_EVENT_*
+  SLOTS = 4096 # how many events the ring keeps
+
+  # ring: shared memory name (e.g. /megacode), socket: unix socket path
+  def initialize(ring = nil, socket = nil)
+    if ring then
+      raise "the shared memory ring requires the native library (run make)" unless NativeEdgeDetector.available?
+      library = Fiddle.dlopen(NativeEdgeDetector::LIBRARY)
+      create = Fiddle::Function.new(library["megacode_ring_create"], [Fiddle::TYPE_VOIDP, -Fiddle::TYPE_INT], Fiddle::TYPE_VOIDP)
+      @ring = create.call(ring, SLOTS)
+      raise "could not create shared memory ring #{ring}" if @ring.null?
+      @ring.free = library["megacode_ring_close"]
+      @publish = Fiddle::Function.new(library["megacode_ring_publish"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP], -Fiddle::TYPE_LONG_LONG)
+      @event = Fiddle::Pointer.malloc(EVENT_SIZE, Fiddle::RUBY_FREE)
+    end
+    @sequence = 0 # the last event sequence (without ring)
+    if socket then
+      File.unlink(socket) if File.socket?(socket)
+      @server = UNIXServer.new(socket)
+      @clients = []
+      @lock = Mutex.new # the clients are accepted in another thread
+      Thread.new do
+        loop do
+          client = @server.accept
+          @lock.synchronize { @clients << client }
+        end
+      end
+    end
+  end
+
+  # publish a value (see print_value), offset is the start of the transmission in ms
+  def publish(value, offset, snr: nil, combined: nil, press: nil, channel: nil)
+    frames = combined ? combined[1] : (press ? press[0] : 0)
+    kind = KINDS[combined ? :code : (press ? :press : :value)]
+    event = [0, 0, (offset*1000).round, value, (value >> 3) & 65535, (value >> 19) & 15, value & 7, snr || Float::NAN, channel || 0, frames, combined ? (combined[0]*100).round : 0, kind, press ? ((press[2]-press[1])*1000).round : 0]
+    if @ring then # the ring sets the sequence and time
+      @event[0, EVENT_SIZE] = event.pack(EVENT)
+      @publish.call(@ring, @event)
+      data = @event[0, EVENT_SIZE]
+    else
+      @sequence += 1
+      event[0, 2] = [@sequence, Process.clock_gettime(Process::CLOCK_REALTIME, :microsecond)]
+      data = event.pack(EVENT)
+    end
+    if @server then
+      @lock.synchronize do
+        @clients.reject! do |client|
+          begin
+            next false if client.write_nonblock(data)==data.bytesize
+          rescue IO::WaitWritable, SystemCallError, IOError
+          end
+          client.close # too slow or disconnected (a partial event would shift the next ones)
+          true
+        end
+      end
+    end
+  end
+end
+
+# print decoded value (and signal to noise ratio, if known, number of frames and confidence, if combined, number of frames and start and end in ms, if a press, and channel, if wideband)
+def print_value(value, snr: nil, combined: nil, press: nil, channel: nil)
+  button = value & 7
+  code = (value >> 3) & 65535
+  facility = (value >> 19) & 15
+  printf("- %s: 0X%06x, code: %05d, facility: %d, button: %d", press ? "press" : "value", value, code, facility, button)
+  printf(", snr: %.1fdB", snr) if snr
+  printf(", frames: %d, confidence: %d%%", combined[1], (combined[0]*100).round) if combined
+  printf(", frames: %d, start: %.3fs, end: %.3fs", press[0], press[1]/1000.0, press[2]/1000.0) if press
+  printf(", channel: %+dkHz", channel/1000) if channel
+  puts
+end
+
+# a remote between two channels (or a strong one) is decoded in several, only report it in the channel where it is the strongest
+# a duplicate has the same value, is in another channel, and at the same time (within a bitframe)
+# entries are [value, channel, start, end, quality (nil if unknown), ...]
+def duplicate(reported, entry)
+  reported.find do |other|
+    other[0]==entry[0] and other[1]!=entry[1] and other[2]<entry[3]+6 and entry[2]<other[3]+6
+  end
+end
+# remove the duplicates from the entries (sorted by time), keeping the strongest (the first one if they are as strong)
+# the entries of a value overlapping in time form a cluster (even if the first and last ones do not overlap), only one entry of the cluster is kept
+def deduplicate(entries)
+  kept = []
+  clusters = {} # the last cluster of every value: [index of its entry in kept, end of the cluster]
+  entries.each do |entry|
+    cluster = clusters[entry[0]]
+    if cluster and entry[2]<cluster[1]+6 then # the entry starts after the ones of the cluster, so it overlaps if it starts before the end
+      cluster[1] = [cluster[1], entry[3]].max
+      kept[cluster[0]] = entry if (entry[4] || -Float::INFINITY)>(kept[cluster[0]][4] || -Float::INFINITY)+1e-9 # ignore the rounding errors
+    else
+      clusters[entry[0]] = [kept.size, entry[3]]
+      kept << entry
+    end
+  end
+  return kept
+end
+
+# yield the raw samples of the file from offset to stop (in bytes), in blocks of at most size bytes
+# the native library processes the mapped file in place (see MappedFile), the ruby edge detection needs strings
+def read_blocks(file, offset, stop, size, &block)
+  if NativeEdgeDetector.available? then
+    MappedFile.new(file).each_block(offset, stop, size, &block)
+  else
+    file.seek(offset)
+    while offset<stop and raw = file.read([size, stop-offset].min) do
+      offset += raw.bytesize
+      yield raw
+    end
+  end
+end
+
+# the usual sample rates, the detected rate is one of them
+RATES = [8000, 11025, 16000, 22050, 24000, 32000, 44100, 48000, 96000, 120000, 192000, 240000, 250000, 1200000, 2400000]
+DETECT = MappedFile::WINDOW # at most how many bytes to read to detect the sample rate (the rate is needed to find the time range, so they are at the beginning of the file)
+# detect the sample rate of a rtl_fm recording from the pulse timings
+# the edges are merged in pulses (at most 1ms long), and in a transmission the pulses are 3, 6, or 9ms apart
+# noise pulses also match sometimes, thus only runs of matching intervals (at least a third of a transmission) are counted
+# the rate with the most pulse intervals matching is used, return nil if no rate matches a transmission
+def detect_rate(path, adaptive)
+  # the adaptive threshold depends on the rate, the edges are detected for every group of rates with the same adaptation
+  # the samples are only read once, every block is given to the detector of every group
+  groups = RATES.group_by { |rate| adaptive ? AdaptiveEdgeDetector.shift(rate) : 0 }.values
+  detectors = groups.collect do |rates|
+    if NativeEdgeDetector.available? then
+      NativeEdgeDetector.new(adaptive, rates[0])
+    else
+      adaptive ? AdaptiveEdgeDetector.new(rates[0]) : EdgeDetector.new
+    end
+  end
+  rising = groups.collect { [] } # the rising edges of every group (sample indexes)
+  sample = 0 # index of the next sample
+  File.open(path, "rb") do |file|
+    stop = [file.size, DETECT].min
+    read_blocks(file, 0, stop-stop%2, BLOCK*2) do |raw|
+      detectors.each_with_index do |detector, i|
+        next if rising[i].size>=24*16 # enough pulses for this group
+        detector.detect(raw) do |index, up|
+          rising[i] << sample+index if up
+        end
+      end
+      sample += raw_size(raw)/2
+      break if rising.all? { |edges| edges.size>=24*16 }
+    end
+  end
+  matches = groups.zip(rising).collect do |rates, edges|
+    rates.collect do |rate|
+      pulse_length = 1*TOLERANCE*rate/1000
+      pulses = [] # the start of the pulses
+      edges.each do |edge|
+        pulses << edge if pulses.empty? or edge-pulses[-1]>pulse_length
+      end
+      runs = pulses.each_cons(2).chunk do |previous, pulse|
+        ms = (pulse-previous)*1000.0/rate
+        [3, 6, 9].any? { |interval| (ms-interval).abs<=0.5 }
+      end
+      [runs.inject(0) { |total, (match, intervals)| total+((match and intervals.size>=8) ? intervals.size : 0) }, rate]
+    end
+  end.flatten(1)
+  best, rate = matches.max_by { |match, rate| [match, rate==RATE ? 1 : 0] }
+  return best>0 ? rate : nil
+end
+
+# decode a file (or the standard input if path is '-') and print the results
+# range is the start and end (nil for the end of the file) of the part of the file to decode, in seconds (nil for the whole file)
+# rate is the sample rate of the input in Hz (the IQ sample rate with -i), nil to detect it from the file (or use the default one)
+# publisher also publishes the values and codes to the local consumers (see Publisher)
+# store also stores the values: [time (in us since the epoch), value, source, snr] are appended to it (see EventStore)
+# presses reports the button presses instead of every value (see PressAggregator)
+# return the totals (number of samples read, values, codes, and presses)
+def decode(path, adaptive, combine, wideband, iq, range = nil, rate = nil, publisher = nil, store = nil, presses = false)
+  stream = (path=="-")
+  raise "a time range can only be decoded from a file" if stream and range
+  raise "wideband decoding only supports #{IQ_RATE}Hz" if wideband and rate and rate!=IQ_RATE
+  detected = (!rate and !stream and !wideband and !iq) ? detect_rate(path, adaptive) : nil
+  rate ||= detected || ((wideband or iq) ? IQ_RATE : RATE)
+  channelizer = Channelizer.new if wideband
+  # when the capture started, in us (the file is closed when the capture ends)
+  if stream then
+    origin = (Time.now.to_r*1000000).to_i
   else
-    if sample < THRESHOLD then
-      on = false
-      edges << {:sample => i, :rising => false}
-    end
-  end
-end
-
-edges.collect!{|edge| {:ms => edge[:sample]/(RATE/1000.0), :rising => edge[:rising]}} # convert edges to milliseconds
-# the bursts (HF activity) should last 1ms
-# verify if this is true, and ignore oscilastion within this 1ms
-pulses = [] # one transmission has 24 pulses
-pulse_begin = nil # first rising edge
-pulse_end = nil # last falling edge
-edges.each do |edge|
-  raise "nil edge" unless edge
-  # search first pulse (rising edge)
-  unless pulse_begin then
-    next unless edge[:rising]
-    pulse_begin = edge
-  end
-  # detect pulses: falling and rising edge within 1ms
-  # ignore edges within this 1ms
-  if !edge[:rising] then
-    pulse_end ||= edge
-    if pulse_end[:ms]-pulse_begin[:ms]<=1*TOLERANCE then
-      pulse_end = edge
-    else # this is too long for a pulse. discard it
-      pulse_begin = nil
-    end
-  else # rising edge
-    if edge[:ms]-pulse_begin[:ms]>1*TOLERANCE then # this is the beginning of the next pulse
-      raise "two rising egdes without falling edge detected" unless pulse_end # this should not happen
-      pulses << pulse_begin
-      pulse_begin = edge
-      pulse_end = nil
-    end # ignore rising egdes within a pulse
-  end
-end
-# add last pulse
-pulses << pulse_begin if pulse_begin and pulse_end
-    
-# split pulses into groups
-# one group has 24 pulses with a bitframe of 6ms
-# a blank bitframe without pulse separates groups
-# we will split groups when no pulse occured within after 2 bitframes
-groups = []
-previous_pulse = nil
-group = []
-pulses.each do |pulse|
-  if previous_pulse then
-    group << previous_pulse
-    if (pulse[:ms]-previous_pulse[:ms])>=2*6*(1-(TOLERANCE-1)) then
-      groups << group
-      group = []
-    end
-  end
-  previous_pulse = pulse
-end
-# add last pulse
-group << pulses[-1]
-groups << group
-
-# transmissions have 24 pulses
-transmissions = groups.select {|group| group.size==24}
-
-# verify that there is exactly 24 times one pulse per 6ms bitframe
-# the pulse is either after 2 ms or 5 ms
-values = []
-transmissions.each_index do |transmission_i|
-  transmission = transmissions[transmission_i]
-  # use the previous pulse to sync
-  sync = transmission[0][:ms]-3 # the first pulse is always in the second halt (after 5 ms)
-  bits = []
-  transmission.each_index do |pulse_i|
-    pulse = transmission[pulse_i]
-    # the next pulse is after 6 or 9 ms
-    offset = pulse[:ms]-sync
-#    puts "transmission #{transmission_i}, pulse #{pulse_i}, offset: #{offset} ms"
-    if offset>-1.5 and offset<=1.5 then
-      bits << 0
-      sync = pulse[:ms]+6
-    elsif offset>3-1.5 and offset<=3+1.5 then
-      bits << 1
-      sync = pulse[:ms]-3+6
+    origin = (File.mtime(path).to_r*1000000).to_i-File.size(path)/2*1000000/rate+(range ? (range[0]*1000000).round : 0)
+  end
+  if store.is_a?(EventStore) and store.last and origin<store.last then # the events are stored in time order
+    raise "the capture starts at #{Time.at(origin/1000000r)}, before the last event stored (#{Time.at(store.last/1000000r)}), only newer captures can be stored"
+  end
+  source = stream ? "stdin" : File.expand_path(path)
+  sizes = [] # the group sizes (only for files since it grows over time)
+  values = [] # the decoded values (only for files, else they are printed directly)
+  codes = [] # the combined values (only for files, else they are printed directly)
+  pressed = [] # the button presses (only for files, else they are printed directly)
+  channels = wideband ? channelizer.offsets : [nil] # the channel of every decoder
+  held = [] # the events of the channels not reported yet: [kind, entry, time when decoded in ms] (only for streams with several channels)
+  reported = {value: [], code: [], press: []} # the entries already reported (only for streams with several channels)
+  # print and publish a value, start is the start of the transmission in ms
+  # when reporting the presses, the values they fold are only stored
+  report = lambda do |value, start, **options|
+    unless presses and !options[:combined] and !options[:press] then
+      print_value(value, **options)
+      publisher.publish(value, start, **options) if publisher
+    end
+    store << [origin+(start*1000).round, value, source+(options[:channel] ? format(" %+dkHz", options[:channel]/1000) : ""), options[:snr]] if store and !options[:combined] and !options[:press]
+  end
+  # report an entry of values ([value, channel, start, start, snr]), codes ([value, channel, start, end, confidence, frames]), or pressed ([value, channel, start, end, snr, frames])
+  report_entry = lambda do |kind, entry|
+    value, channel, start, stop, quality, frames = entry
+    case kind
+    when :value
+      report.call(value, start, snr: quality, channel: channel)
+    when :code
+      report.call(value, start, combined: [quality, frames], channel: channel)
+    when :press
+      report.call(value, start, snr: quality, press: [frames, start, stop], channel: channel)
+    end
+  end
+  # keep the entry for the end (files), report it (streams), or hold it until its duplicates from the other channels are decoded (streams with several channels)
+  collect = lambda do |kind, entry, list|
+    if !stream then
+      list << entry
+    elsif entry[1] then
+      held << [kind, entry, nil]
+    else
+      report_entry.call(kind, entry)
+    end
+  end
+  # report the held entries once the other channels had the time to decode their duplicates (within a bitframe), only the strongest of every cluster
+  # time is the time decoded so far in ms (nil to report them all)
+  release = lambda do |time|
+    held.each { |hold| hold[2] ||= time }
+    ready = held.select { |kind, entry, at| !time or time-at>=6 }
+    ready |= held.select { |kind, entry| ready.any? { |other_kind, other| other_kind==kind and duplicate([other], entry) } } # with their duplicates decoded since
+    held -= ready
+    {value: Combiner::BURST, code: Combiner::BURST, press: PressAggregator::GAP}.each do |kind, window|
+      entries = ready.select { |hold| hold[0]==kind }.collect { |hold| hold[1] }.sort_by { |value, channel, start| [start, channel] }
+      deduplicate(entries).each do |entry|
+        report_entry.call(kind, entry) unless duplicate(reported[kind], entry) # a duplicate decoded a block earlier has already been reported
+      end
+      reported[kind].concat(entries)
+      reported[kind].reject! { |other| other[3]<time-window } if time # the older entries can not be duplicates
+    end
+  end
+  # handle the events of the decoder of the channel
+  handle = lambda do |channel, event, *args|
+    case event
+    when :group
+      sizes << args[0] unless stream or wideband
+    when :error
+      puts "could not decode bit on transmission #{args[0]} pulse #{args[1]}" + (channel ? format(" on channel %+dkHz", channel/1000) : "")
+    when :value
+      collect.call(:value, [args[0], channel, args[2], args[2], args[1]], values)
+    when :code
+      collect.call(:code, [args[0], channel, args[3], args[4], args[1], args[2]], codes)
+    when :press
+      collect.call(:press, [args[0], channel, args[3], args[4], args[2], args[1]], pressed)
+    end
+  end
+  lock = Mutex.new # the channels are processed in parallel (see Channelizer#split), but their events are handled one at a time
+  decoders = channels.collect do |channel|
+    Decoder.new(adaptive, combine, iq, wideband ? RATE : rate, presses) do |event, *args|
+      lock.synchronize { handle.call(channel, event, *args) }
+    end
+  end
+  samples = 0 # number of samples read
+  # feed the raw samples to the decoder, or the IQ samples to the channel decoders
+  feed = lambda do |raw|
+    samples += raw_size(raw)/2
+    if wideband then
+      channelizer.split(raw) do |i, channel_samples|
+        decoders[i].feed(channel_samples)
+      end
+      release.call(samples*1000.0/rate) if stream
     else
-      puts "could not decode bit on transmission #{transmission_i} pulse #{pulse_i}"
-      break
+      decoders[0].feed(raw)
     end
+    store.advance(origin+samples*1000000/rate) if stream and store.respond_to?(:advance) # the values stored until now can be written once they can not be reordered anymore
   end
-  # if there are 24 bit, decode
-  if bits.size==24 then
-    value = 0
-    bits.each do |bit| 
-      value = (value << 1) + bit
+  block = (wideband or iq) ? BLOCK*rate/RATE : BLOCK # samples to read at once (IQ samples are also 2 bytes)
+  stream_block = wideband ? block : [STREAM_BLOCK*rate/RATE, 1].max # the channels are only split in large blocks
+
+  if stream then
+    $stdout.sync = true # output values as soon as they are decoded
+    store.sync = true if store.respond_to?(:sync=) # and store them
+    $stdin.binmode
+    rest = "".b # incomplete sample from the previous read
+    begin
+      loop do
+        raw = rest+$stdin.readpartial(stream_block*2) # read what is available
+        rest = raw.bytesize.odd? ? raw[-1] : "".b # keep the incomplete sample for later
+        feed.call(raw[0, raw.bytesize-rest.bytesize])
+      end
+    rescue EOFError, Interrupt
     end
-    values << value
   else
-#    puts "found #{bits.size} bits"
+    File.open(path, "rb") do |file|
+      offset = range ? (range[0]*rate).round*2 : 0 # where to start decoding, in bytes
+      stop = file.size-file.size%2 # where to stop decoding, in bytes
+      stop = [stop, (range[1]*rate).round*2].min if range and range[1]
+      read_blocks(file, offset, stop, block*2) do |raw|
+        feed.call(raw)
+      end
+    end
+  end
+  decoders.each(&:finish)
+  release.call(nil) if stream and wideband
+  if wideband then # sort the values from the channels by time, and only keep the strongest of the duplicates
+    values = deduplicate(values.sort_by { |value, channel, start| [start, channel] })
+    codes = deduplicate(codes.sort_by { |value, channel, start| [start, channel] })
+    pressed = deduplicate(pressed.sort_by { |value, channel, start| [start, channel] })
+  end
+
+  # print results
+  puts "# channels: #{channels.size}" if wideband
+  puts "# rate: #{rate}Hz" + (detected ? " (detected)" : "") if rate!=((wideband or iq) ? IQ_RATE : RATE)
+  puts "# egdes: #{decoders.inject(0) { |sum, decoder| sum+decoder.edges }}"
+  puts "# pulses: #{decoders.inject(0) { |sum, decoder| sum+decoder.pulses }}"
+  puts "# groups: #{decoders.inject(0) { |sum, decoder| sum+decoder.groups }}" + ((stream or wideband) ? "" : " (#{sizes*', '})")
+  puts "# transmissions: #{decoders.inject(0) { |sum, decoder| sum+decoder.transmissions }}"
+  puts "# values: #{decoders.inject(0) { |sum, decoder| sum+decoder.values }}"
+  unless values.empty? then
+    puts "values: " unless presses # they are only stored
+    values.each { |entry| report_entry.call(:value, entry) }
+  end
+  if combine then
+    puts "# codes: #{decoders.inject(0) { |sum, decoder| sum+decoder.codes }}"
+    unless codes.empty? then
+      puts "codes: "
+      codes.each { |entry| report_entry.call(:code, entry) }
+    end
+  end
+  if presses then
+    puts "# presses: #{decoders.inject(0) { |sum, decoder| sum+decoder.presses }}"
+    unless pressed.empty? then
+      puts "presses: "
+      pressed.each { |entry| report_entry.call(:press, entry) }
+    end
+  end
+  store.flush if store.respond_to?(:flush)
+  return {samples: samples, values: decoders.inject(0) { |sum, decoder| sum+decoder.values }, codes: decoders.inject(0) { |sum, decoder| sum+decoder.codes }, presses: decoders.inject(0) { |sum, decoder| sum+decoder.presses }}
+end
+
+# decode the files in parallel, in forked processes (the decoder is in ruby and the GVL would serialize threads)
+# the output of every file is captured by its process, and printed in the order of the files
+# return the totals of every file
+def decode_batch(paths, workers, &decode)
+  queue = Queue.new # the index of the files left to decode
+  paths.each_index { |i| queue << i }
+  results = Array.new(paths.size)
+  threads = [workers, paths.size].min.times.collect do
+    Thread.new do # every thread waits for one process at a time
+      while i = (queue.pop(true) rescue nil) do
+        reader, writer = IO.pipe
+        pid = fork do
+          reader.close
+          $stdout = StringIO.new # capture the report
+          begin
+            totals = decode.call(paths[i])
+            writer.write(Marshal.dump([$stdout.string, totals]))
+          rescue StandardError => e
+            writer.write(Marshal.dump([$stdout.string+"could not decode file: #{e.message}\n", nil]))
+          end
+          writer.close
+          exit!(0) # do not run the parent exit handlers
+        end
+        writer.close
+        data = reader.read
+        reader.close
+        _, status = Process.wait2(pid)
+        # the process can die without reporting (signal, or not a StandardError), only this file failed
+        begin
+          results[i] = Marshal.load(data) if status.success? and !data.empty?
+        rescue ArgumentError, TypeError # incomplete report
+        end
+        unless results[i] then
+          reason = status.signaled? ? "killed by signal #{status.termsig}" : (status.success? ? "incomplete report" : "exit status #{status.exitstatus}")
+          results[i] = ["could not decode file: #{reason}\n", nil]
+        end
+      end
+    end
   end
+  threads.each(&:join)
+  return results
 end
 
-# print results
-puts "# egdes: #{edges.size}"
-puts "# pulses: #{pulses.size}"
-puts "# groups: #{groups.size} (#{groups.collect{|group| group.size}*', '})"
-puts "# transmissions: #{transmissions.size}"
-puts "# values: #{values.size}"
-unless values.empty? then
-  puts "values: "
-  values.each do |value|
-    button = value & 7
-    code = (value >> 3) & 65535
-    facility = (value >> 19) & 15
-    printf("- value: 0X%06x, code: %05d, facility: %d, button: %d\n", value, code, facility, button)
+adaptive = !ARGV.delete("-a").nil?
+combine = !ARGV.delete("-c").nil?
+wideband = !ARGV.delete("-w").nil?
+iq = !ARGV.delete("-i").nil?
+presses = !ARGV.delete("-b").nil?
+range = nil # the part of the files to decode (start and end in seconds)
+if index = ARGV.index("-r") then
+  raise "provide the time range to decode after -r (e.g. 02:00-02:15)" unless ARGV[index+1] =~ /\A([\d:.]+)-([\d:.]*)\z/
+  range = [$1, $2].collect do |time| # [[hh:]mm:]ss
+    time.empty? ? nil : time.split(":").inject(0) { |seconds, part| seconds*60+part.to_f }
+  end
+  ARGV.slice!(index, 2)
+end
+rate = nil # the sample rate of the files (nil to detect it)
+if index = ARGV.index("--rate") then
+  raise "provide the sample rate after --rate (in Hz, e.g. 48000 or 2.4M)" unless ARGV[index+1] =~ /\A(\d+(?:\.\d+)?)([kM]?)\z/
+  rate = ($1.to_f*{""=>1, "k"=>1000, "M"=>1000000}[$2]).round
+  ARGV.slice!(index, 2)
+end
+ring = nil # the shared memory ring to publish the events to
+if index = ARGV.index("-s") then
+  raise "provide the shared memory name after -s (e.g. /megacode)" unless ARGV[index+1] =~ /\A\/[^\/]+\z/
+  ring = ARGV[index+1]
+  ARGV.slice!(index, 2)
+end
+socket = nil # the unix socket to publish the events to
+if index = ARGV.index("-u") then
+  raise "provide the unix socket path after -u" unless ARGV[index+1]
+  socket = ARGV[index+1]
+  ARGV.slice!(index, 2)
+end
+store = nil # the event store to append the values to
+if index = ARGV.index("-e") then
+  raise "provide the event store directory after -e" unless ARGV[index+1]
+  store = EventStore.new(ARGV[index+1], true)
+  ARGV.slice!(index, 2)
+end
+if (wideband or iq) and !NativeEdgeDetector.available? then
+  raise "#{wideband ? 'wideband' : 'IQ'} decoding requires the native library (run make)"
+end
+adaptive = true if wideband # the envelope level depends on the gain, a fixed threshold does not apply
+if ARGV.size==1 and (ARGV[0]=="-" or File.file? ARGV[0]) then
+  publisher = (ring or socket) ? Publisher.new(ring, socket) : nil
+  decode(ARGV[0], adaptive, combine, wideband, iq, range, rate, publisher, store, presses)
+else # batch mode: decode every file, and the capture files in the directories
+  raise "the events can only be published when decoding one file" if ring or socket
+  raise "provide raw AM file to decode as argument (or - to read from standard input, or several files and directories)" if ARGV.empty?
+  paths = ARGV.collect do |path|
+    if File.directory? path then
+      Dir.glob(File.join(path, (wideband or iq) ? "*.iq" : "*.pcm")).sort
+    elsif File.file? path then
+      path
+    else
+      raise "#{path} is not a file or directory"
+    end
+  end.flatten
+  workers = Etc.respond_to?(:nprocessors) ? Etc.nprocessors : 1 # one process per core
+  start = Time.now
+  results = decode_batch(paths, workers) do |path|
+    events = store ? [] : nil # the processes can not write to the store, the values are stored afterwards
+    decode(path, adaptive, combine, wideband, iq, range, rate, nil, events, presses).merge(events: events)
+  end
+  duration = Time.now-start
+  if store then # in time order
+    events = results.collect { |_, total| total && total[:events] }.compact.flatten(1).sort_by(&:first)
+    if store.last and !events.empty? and events[0][0]<store.last then # nothing is stored
+      raise "the event at #{Time.at(events[0][0]/1000000r)} (#{events[0][2]}) is before the last event stored (#{Time.at(store.last/1000000r)}), only newer captures can be stored"
+    end
+    events.each { |event| store << event }
+    store.flush
+  end
+  # print the report of every file, and the totals
+  paths.zip(results).each do |path, (output, _)|
+    puts "file: #{path}"
+    puts output
   end
+  totals = results.collect { |_, total| total }.compact
+  samples = totals.inject(0) { |sum, total| sum+total[:samples] }
+  puts "# files: #{paths.size}" + (totals.size<paths.size ? " (#{paths.size-totals.size} failed)" : "")
+  puts "# workers: #{[workers, paths.size].min}"
+  puts "# values: #{totals.inject(0) { |sum, total| sum+total[:values] }}"
+  puts "# codes: #{totals.inject(0) { |sum, total| sum+total[:codes] }}" if combine
+  puts "# presses: #{totals.inject(0) { |sum, total| sum+total[:presses] }}" if presses
+  printf("# time: %.2fs (%.0f samples/s, %.1f files/s)\n", duration, samples/duration, paths.size/duration)
 end
@@ -0,0 +1,286 @@
+/* embeddable MegaCode decoder
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* the same decoding as the Decoder class in decode.rb, without ruby
+ * the edges are detected in the pushed samples a block at a time (megacode_edges or megacode_edges_agc), in a buffer of the context
+ * the edges are then merged in pulses, the pulses split in groups, and the groups of 24 pulses decoded in frames
+ * the signal to noise ratio of a frame is the highest level of its pulses over the noise floor before its first pulse (from the edge levels)
+ * all the state is in the context, nothing is allocated after megacode_decoder_new
+ */
+/* libraries */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+#include "megacode.h"
+
+/* decoder parameters (see decode.rb) */
+#define DECODER_RATE 24000 /* sample rate the adaptive threshold is tuned for, in Hz */
+#define DECODER_THRESHOLD 16384 /* fixed threshold (half the positive range) */
+#define DECODER_TOLERANCE 1.10 /* how much deviation to accept */
+#define DECODER_BLOCK 4096 /* how many samples to detect the edges of at once */
+#define DECODER_PULSES 24 /* pulses per frame */
+
+struct megacode_decoder {
+	megacode_frame_callback callback; /* called for every decoded frame */
+	void* context; /* passed to the callback */
+	int adaptive; /* use the adaptive threshold instead of the fixed one */
+	int32_t shift; /* adaptive threshold rate shift (see struct megacode_agc) */
+	/* the timing thresholds in samples */
+	int64_t pulse_length; /* a pulse lasts at most 1ms */
+	int64_t blank; /* no pulse for 2 bitframes ends the group */
+	int64_t bitframe; /* bitframe duration (6ms) */
+	int64_t one; /* distance between the 0 (after 2ms) and 1 (after 5ms) pulse positions */
+	int64_t window; /* the pulses can be this far from their expected position */
+	/* edge detection */
+	uint8_t level; /* fixed threshold state between the blocks */
+	struct megacode_agc agc; /* adaptive threshold state */
+	uint32_t edges[DECODER_BLOCK]; /* the edges of the current block */
+	int32_t levels[DECODER_BLOCK]; /* the levels of the edges of the current block (-1 if unknown) */
+	/* pulses */
+	int64_t sample; /* index of the next sample */
+	int on; /* is the signal above the threshold */
+	int64_t pulse_begin; /* first rising edge of the current pulse (-1 if none) */
+	int64_t pulse_end; /* last falling edge of the current pulse (-1 if none) */
+	int32_t pulse_noise; /* noise floor before the current pulse (-1 if unknown) */
+	int32_t pulse_top; /* highest level of the current pulse */
+	/* group */
+	unsigned int group_size; /* number of pulses in the group */
+	int64_t group_first; /* sample of the first pulse in the group */
+	int64_t group_last; /* sample of the last pulse in the group */
+	int32_t group_noise; /* noise floor before the first pulse of the group (-1 if unknown) */
+	int32_t group_peak; /* highest level of the pulses in the group */
+	int64_t sync; /* sample when the next 0 pulse is expected */
+	uint32_t value; /* the bits decoded so far */
+	int error; /* is there a pulse which could not be decoded */
+	size_t frames; /* number of frames reported by the current push */
+};
+
+/* start a new group of pulses */
+static void new_group(struct megacode_decoder* decoder)
+{
+	decoder->group_size = 0;
+	decoder->group_first = -1;
+	decoder->group_last = -1;
+	decoder->group_noise = -1;
+	decoder->group_peak = 0;
+	decoder->sync = 0;
+	decoder->value = 0;
+	decoder->error = 0;
+}
+
+/* report the frame of the current group, once its 24th pulse is complete (without waiting for the blank bitframe)
+ * the pulses following it before a blank bitframe make the group too long, they are not decoded
+ */
+static void transmission(struct megacode_decoder* decoder)
+{
+	struct megacode_frame frame;
+	frame.value = decoder->value;
+	frame.code = (decoder->value>>3)&0xffff;
+	frame.facility = (decoder->value>>19)&0xf;
+	frame.button = decoder->value&0x7;
+	frame.sample = decoder->group_first;
+	if (decoder->group_noise>0 && decoder->group_peak>decoder->group_noise) {
+		frame.snr = 20*log10((double)decoder->group_peak/decoder->group_noise);
+	} else {
+		frame.snr = NAN;
+	}
+	decoder->frames++;
+	decoder->callback(&frame, decoder->context);
+}
+
+/* add a pulse to the current group (one pulse per 6ms bitframe, either after 2ms or 5ms)
+ * a new group starts when no pulse occured within 2 bitframes
+ */
+static void pulse(struct megacode_decoder* decoder, int64_t sample)
+{
+	int64_t offset;
+	if (decoder->group_size>0 && sample-decoder->group_last>=decoder->blank) {
+		new_group(decoder);
+	}
+	if (decoder->group_size<DECODER_PULSES && !decoder->error) {
+		if (decoder->group_size==0) { /* the first pulse is always in the second half (after 5ms) */
+			decoder->sync = sample-decoder->one;
+		}
+		offset = sample-decoder->sync;
+		if (offset>-decoder->window && offset<=decoder->window) {
+			decoder->value = (decoder->value<<1)|0;
+			decoder->sync = sample+decoder->bitframe;
+		} else if (offset>decoder->one-decoder->window && offset<=decoder->one+decoder->window) {
+			decoder->value = (decoder->value<<1)|1;
+			decoder->sync = sample-decoder->one+decoder->bitframe;
+		} else {
+			decoder->error = 1;
+		}
+	}
+	if (decoder->group_size==0) {
+		decoder->group_first = sample;
+		decoder->group_noise = decoder->pulse_noise;
+	}
+	if (decoder->pulse_top>decoder->group_peak) {
+		decoder->group_peak = decoder->pulse_top;
+	}
+	decoder->group_size++;
+	decoder->group_last = sample;
+	if (decoder->group_size==DECODER_PULSES && !decoder->error) {
+		transmission(decoder);
+	}
+}
+
+/* merge the edges in 1ms pulses, ignoring the oscillations within a pulse
+ * level is the noise floor for a rising edge, the highest level since the rising edge for a falling edge (-1 if unknown)
+ */
+static void edge(struct megacode_decoder* decoder, int64_t sample, int rising, int32_t level)
+{
+	if (decoder->pulse_begin<0) { /* search the first rising edge */
+		if (!rising) {
+			return;
+		}
+		decoder->pulse_begin = sample;
+		decoder->pulse_noise = level;
+		decoder->pulse_top = 0;
+	}
+	if (!rising) {
+		if (level>decoder->pulse_top) {
+			decoder->pulse_top = level;
+		}
+		if (decoder->pulse_end<0) {
+			decoder->pulse_end = sample;
+		}
+		if (decoder->pulse_end-decoder->pulse_begin<=decoder->pulse_length) {
+			decoder->pulse_end = sample;
+		} else { /* this is too long for a pulse, discard it */
+			decoder->pulse_begin = -1;
+		}
+	} else if (sample-decoder->pulse_begin>decoder->pulse_length) { /* this is the beginning of the next pulse (the rising edges within a pulse are ignored) */
+		if (decoder->pulse_end>=0) { /* the edges alternate, a pulse without falling edge can not happen */
+			pulse(decoder, decoder->pulse_begin);
+		}
+		decoder->pulse_begin = sample;
+		decoder->pulse_end = -1;
+		decoder->pulse_noise = level;
+		decoder->pulse_top = 0;
+	}
+}
+
+/* decode the nb edges of the next length samples (levels is NULL if unknown) */
+static void process(struct megacode_decoder* decoder, const uint32_t* edges, const int32_t* levels, size_t nb, size_t length)
+{
+	size_t i;
+	for (i=0; i<nb; i++) {
+		decoder->on = edges[i]&1;
+		edge(decoder, decoder->sample+(edges[i]>>1), decoder->on, levels ? levels[i] : -1);
+	}
+	decoder->sample += length;
+	/* a pulse is complete once the signal is low 1ms after it started (the next edge can only be the rising edge of the next pulse) */
+	if (decoder->pulse_begin>=0 && decoder->pulse_end>=0 && !decoder->on && decoder->sample-decoder->pulse_begin>decoder->pulse_length) {
+		pulse(decoder, decoder->pulse_begin);
+		decoder->pulse_begin = -1;
+		decoder->pulse_end = -1;
+	}
+}
+
+/* detect the edges of a block (at most DECODER_BLOCK samples) and decode them */
+static void block(struct megacode_decoder* decoder, const int16_t* samples, size_t length)
+{
+	size_t nb;
+	if (decoder->adaptive) {
+		nb = megacode_edges_agc(samples, length, &decoder->agc, decoder->edges, decoder->levels);
+		process(decoder, decoder->edges, decoder->levels, nb, length);
+	} else {
+		nb = megacode_edges(samples, length, DECODER_THRESHOLD, &decoder->level, decoder->edges);
+		process(decoder, decoder->edges, NULL, nb, length);
+	}
+}
+
+struct megacode_decoder* megacode_decoder_new(unsigned int rate, int adaptive, megacode_frame_callback callback, void* context)
+{
+	struct megacode_decoder* decoder;
+	int shift;
+	if (rate==0 || !callback) {
+		return NULL;
+	}
+	decoder = calloc(1, sizeof(struct megacode_decoder));
+	if (!decoder) {
+		return NULL;
+	}
+	decoder->callback = callback;
+	decoder->context = context;
+	decoder->adaptive = adaptive;
+	shift = lround(log2((double)rate/DECODER_RATE));
+	decoder->shift = shift<-4 ? -4 : (shift>8 ? 8 : shift);
+	/* for integers, x>t is x>floor(t), and x>=t is x>=ceil(t) */
+	decoder->pulse_length = floor(1*DECODER_TOLERANCE*rate/1000);
+	decoder->blank = ceil(2*6*(1-(DECODER_TOLERANCE-1))*rate/1000);
+	decoder->bitframe = lround(6*rate/1000.0);
+	decoder->one = lround(3*rate/1000.0);
+	decoder->window = floor(1.5*rate/1000);
+	megacode_decoder_reset(decoder);
+	return decoder;
+}
+
+void megacode_decoder_free(struct megacode_decoder* decoder)
+{
+	free(decoder);
+}
+
+size_t megacode_decoder_push(struct megacode_decoder* decoder, const int16_t* samples, size_t length)
+{
+	size_t i;
+	decoder->frames = 0;
+	for (i=0; i<length; i+=DECODER_BLOCK) {
+		block(decoder, samples+i, length-i<DECODER_BLOCK ? length-i : DECODER_BLOCK);
+	}
+	return decoder->frames;
+}
+
+size_t megacode_decoder_edges(struct megacode_decoder* decoder, const uint32_t* edges, const int32_t* levels, size_t nb, size_t length)
+{
+	decoder->frames = 0;
+	process(decoder, edges, levels, nb, length);
+	return decoder->frames;
+}
+
+size_t megacode_decoder_flush(struct megacode_decoder* decoder)
+{
+	size_t frames;
+	decoder->frames = 0;
+	if (decoder->pulse_begin>=0 && decoder->pulse_end>=0) { /* add the last pulse */
+		pulse(decoder, decoder->pulse_begin);
+	}
+	frames = decoder->frames;
+	megacode_decoder_reset(decoder);
+	return frames;
+}
+
+void megacode_decoder_reset(struct megacode_decoder* decoder)
+{
+	decoder->level = 0;
+	decoder->agc.noise = -1;
+	decoder->agc.deviation = 0;
+	decoder->agc.peak = 0;
+	decoder->agc.level = 0;
+	decoder->agc.shift = decoder->shift;
+	decoder->agc.top = 0;
+	decoder->sample = 0;
+	decoder->on = 0;
+	decoder->pulse_begin = -1;
+	decoder->pulse_end = -1;
+	decoder->pulse_noise = -1;
+	decoder->pulse_top = 0;
+	new_group(decoder);
+}
@@ -0,0 +1,281 @@
+/* edge detection for the MegaCode SDR decoder
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* the samples are compared to the threshold several at a time using SIMD instructions
+ * the comparison results are packed in a bit mask (one bit per sample), where the edges are the bits which differ from the previous one
+ * most blocks have no edge (the signal is either low or high), thus only the bits set are looked at
+ * the IQ front end does the whole chain (DC removal, decimation, AM demodulation, and adaptive threshold) one IQ sample at a time
+ * this way no intermediate sample is written to memory, and the only state kept between samples is the filter state
+ */
+/* libraries */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#include <math.h>
+#include "megacode.h"
+
+/* detect the edges one sample at a time
+ * used for the samples not fitting in a SIMD block, and for the blocks with samples equal to the threshold
+ */
+static size_t edges_scalar(const int16_t* samples, size_t start, size_t end, int16_t threshold, uint8_t* level, uint32_t* edges)
+{
+	size_t nb = 0; /* number of edges found */
+	size_t i;
+	for (i=start; i<end; i++) {
+		if (!*level && samples[i]>threshold) {
+			*level = 1;
+			edges[nb++] = ((uint32_t)i<<1)|1;
+		} else if (*level && samples[i]<threshold) {
+			*level = 0;
+			edges[nb++] = ((uint32_t)i<<1);
+		}
+	}
+	return nb;
+}
+
+/* save the edges from the bit mask of the levels (LSb is the first sample)
+ * return the number of edges saved
+ */
+static inline size_t edges_mask(uint32_t high, uint32_t bits, size_t index, uint8_t* level, uint32_t* edges)
+{
+	size_t nb = 0; /* number of edges found */
+	uint32_t changes = (high^((high<<1)|*level)); /* the samples with a different level than the previous one */
+	unsigned int bit;
+	if (bits<32) {
+		changes &= (1U<<bits)-1;
+	}
+	while (changes) {
+		bit = __builtin_ctz(changes);
+		edges[nb++] = ((uint32_t)(index+bit)<<1)|((high>>bit)&1);
+		changes &= changes-1; /* clear lowest bit set */
+	}
+	*level = (high>>(bits-1))&1;
+	return nb;
+}
+
+size_t megacode_edges(const int16_t* samples, size_t length, int16_t threshold, uint8_t* level, uint32_t* edges)
+{
+	size_t nb = 0; /* number of edges found */
+	size_t i = 0; /* current sample */
+#if defined(__AVX2__)
+	/* 32 samples at a time */
+	const __m256i t32 = _mm256_set1_epi16(threshold);
+	for (; i+32<=length; i+=32) {
+		__m256i a = _mm256_loadu_si256((const __m256i*)(samples+i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(samples+i+16));
+		/* packing works per 128 bits lane, the permutation puts the samples back in order */
+		uint32_t high = _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpgt_epi16(a, t32), _mm256_cmpgt_epi16(b, t32)), 0xd8));
+		uint32_t low = _mm256_movemask_epi8(_mm256_permute4x64_epi64(_mm256_packs_epi16(_mm256_cmpgt_epi16(t32, a), _mm256_cmpgt_epi16(t32, b)), 0xd8));
+		if ((high|low)!=0xffffffff) { /* a sample is equal to the threshold and keeps the previous level */
+			nb += edges_scalar(samples, i, i+32, threshold, level, edges+nb);
+		} else if (high!=(*level ? 0xffffffff : 0)) { /* the level changes */
+			nb += edges_mask(high, 32, i, level, edges+nb);
+		}
+	}
+#endif
+#if defined(__SSE2__)
+	/* 16 samples at a time */
+	const __m128i t16 = _mm_set1_epi16(threshold);
+	for (; i+16<=length; i+=16) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(samples+i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(samples+i+8));
+		uint32_t high = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmpgt_epi16(a, t16), _mm_cmpgt_epi16(b, t16)));
+		uint32_t low = _mm_movemask_epi8(_mm_packs_epi16(_mm_cmplt_epi16(a, t16), _mm_cmplt_epi16(b, t16)));
+		if ((high|low)!=0xffff) { /* a sample is equal to the threshold and keeps the previous level */
+			nb += edges_scalar(samples, i, i+16, threshold, level, edges+nb);
+		} else if (high!=(*level ? 0xffff : 0)) { /* the level changes */
+			nb += edges_mask(high, 16, i, level, edges+nb);
+		}
+	}
+#endif
+	/* remaining samples */
+	nb += edges_scalar(samples, i, length, threshold, level, edges+nb);
+	return nb;
+}
+
+/* adaptive threshold parameters (see struct megacode_agc) */
+#define AGC_FLOOR (1024<<8) /* minimum threshold, to ignore a silent input */
+#define AGC_DEVIATION 14 /* minimum distance between the threshold and the noise floor, in noise deviations */
+#define AGC_NOISE 6 /* noise floor and deviation averaging (1/2^n of the new sample, at 24kHz) */
+#define AGC_DECAY 16 /* peak decay (1/2^n of the distance to the noise floor per sample, at 24kHz) */
+
+/* process the next sample (magnitude is the unwrapped sample << 8) with the adaptive threshold
+ * return 1 on a rising edge, 0 on a falling edge, -1 else
+ */
+static inline int agc_sample(struct megacode_agc* agc, int32_t magnitude)
+{
+	int edge = -1;
+	int32_t span; /* distance between the peak and the noise floor */
+	int32_t threshold;
+	if (agc->noise<0) { /* first sample */
+		agc->noise = magnitude;
+		agc->deviation = 0;
+		agc->peak = magnitude;
+	}
+	span = agc->peak-agc->noise;
+	if (agc->level) { /* falling below the middle minus hysteresis */
+		if (magnitude>agc->peak) {
+			agc->peak = magnitude;
+			span = agc->peak-agc->noise;
+		}
+		if (magnitude>agc->top) {
+			agc->top = magnitude;
+		}
+		if (magnitude<agc->noise+(span>>1)-(span>>3)) {
+			agc->level = 0;
+			edge = 0;
+		}
+	} else { /* rising above the middle plus hysteresis, and clearly above the noise */
+		threshold = agc->noise+(span>>1)+(span>>3);
+		if (threshold<agc->noise+agc->deviation*AGC_DEVIATION) {
+			threshold = agc->noise+agc->deviation*AGC_DEVIATION;
+		}
+		if (threshold<AGC_FLOOR) {
+			threshold = AGC_FLOOR;
+		}
+		if (magnitude>threshold) {
+			agc->level = 1;
+			if (magnitude>agc->peak) {
+				agc->peak = magnitude;
+			}
+			agc->top = magnitude;
+			edge = 1;
+		} else {
+			agc->deviation += ((magnitude>agc->noise ? magnitude-agc->noise : agc->noise-magnitude)-agc->deviation)>>(AGC_NOISE+agc->shift);
+			agc->noise += (magnitude-agc->noise)>>(AGC_NOISE+agc->shift);
+		}
+	}
+	agc->peak -= (agc->peak-agc->noise)>>(AGC_DECAY+agc->shift);
+	return edge;
+}
+
+size_t megacode_edges_agc(const int16_t* samples, size_t length, struct megacode_agc* agc, uint32_t* edges, int32_t* levels)
+{
+	size_t nb = 0; /* number of edges found */
+	size_t i;
+	int edge;
+	for (i=0; i<length; i++) {
+		edge = agc_sample(agc, (samples[i]<0 ? (int32_t)samples[i]+0x10000 : samples[i])<<8); /* unwrap the overflowed samples */
+		if (edge>=0) {
+			if (levels) {
+				levels[nb] = edge ? agc->noise : agc->top; /* the noise floor is not updated during the pulse */
+			}
+			edges[nb++] = ((uint32_t)i<<1)|edge;
+		}
+	}
+	return nb;
+}
+
+/* IQ front end parameters (see struct megacode_frontend) */
+#define FRONTEND_ORDER 4 /* CIC filter order (number of integrator and comb stages) */
+#define FRONTEND_DC 16 /* DC offset averaging (1/2^n of the new sample) */
+#define FRONTEND_BITS 9 /* bits of the centered IQ samples, after DC removal */
+
+struct megacode_frontend {
+	unsigned int decimation; /* number of IQ samples per output sample */
+	unsigned int phase; /* number of IQ samples received since the last output */
+	int32_t dc[2]; /* DC offset of I and Q, << FRONTEND_DC */
+	uint64_t integrators[2][FRONTEND_ORDER]; /* CIC integrator stages of I and Q (they wrap, only the differences matter) */
+	uint64_t combs[2][FRONTEND_ORDER]; /* CIC comb stages delays of I and Q */
+	float gain; /* scale the CIC output to the AGC levels (16 bits envelope << 8) */
+};
+
+struct megacode_frontend* megacode_frontend_new(unsigned int decimation)
+{
+	struct megacode_frontend* frontend;
+	double growth = 1; /* CIC gain */
+	unsigned int i;
+	for (i=0; i<FRONTEND_ORDER; i++) {
+		growth *= decimation;
+	}
+	/* the CIC output must fit in the integrators */
+	if (decimation==0 || growth*(1<<FRONTEND_BITS)>=(double)(1ULL<<63)) {
+		return NULL;
+	}
+	frontend = calloc(1, sizeof(struct megacode_frontend));
+	if (!frontend) {
+		return NULL;
+	}
+	frontend->decimation = decimation;
+	frontend->dc[0] = frontend->dc[1] = -1; /* negative until the first sample */
+	frontend->gain = 128*256/growth; /* the centered samples are twice the uint8 samples, like the rtl_fm envelope the maximum (255*√2) is scaled to 16 bits */
+	return frontend;
+}
+
+void megacode_frontend_free(struct megacode_frontend* frontend)
+{
+	free(frontend);
+}
+
+size_t megacode_frontend_edges(struct megacode_frontend* frontend, const uint8_t* iq, size_t length, struct megacode_agc* agc, uint32_t* edges, int32_t* levels, size_t* samples)
+{
+	size_t nb = 0; /* number of edges found */
+	size_t outputs = 0; /* number of output samples */
+	size_t i;
+	unsigned int c, s;
+	int32_t x; /* centered sample */
+	uint64_t y; /* filtered sample */
+	float filtered[2]; /* the decimated I and Q */
+	float magnitude;
+	int edge;
+	for (i=0; i<length; i++) {
+		for (c=0; c<2; c++) { /* I and Q */
+			x = iq[i*2+c]*2-255; /* center on 127.5, as odd integers */
+			if (frontend->dc[c]<0) { /* first sample */
+				frontend->dc[c] = (x+256)<<FRONTEND_DC; /* offset to stay positive */
+			}
+			frontend->dc[c] += (((x+256)<<FRONTEND_DC)-frontend->dc[c])>>FRONTEND_DC;
+			x -= ((frontend->dc[c]+(1<<(FRONTEND_DC-1)))>>FRONTEND_DC)-256; /* remove the DC offset (this is the strong spike in the middle of the rtl_sdr spectrum) */
+			frontend->integrators[c][0] += (uint64_t)(int64_t)x;
+			for (s=1; s<FRONTEND_ORDER; s++) {
+				frontend->integrators[c][s] += frontend->integrators[c][s-1];
+			}
+		}
+		if (++frontend->phase<frontend->decimation) {
+			continue;
+		}
+		frontend->phase = 0;
+		/* decimate: comb stages, at the output rate */
+		for (c=0; c<2; c++) {
+			y = frontend->integrators[c][FRONTEND_ORDER-1];
+			for (s=0; s<FRONTEND_ORDER; s++) {
+				uint64_t delayed = frontend->combs[c][s];
+				frontend->combs[c][s] = y;
+				y -= delayed;
+			}
+			filtered[c] = (int64_t)y;
+		}
+		/* AM envelope, directly to the adaptive threshold */
+		magnitude = sqrtf(filtered[0]*filtered[0]+filtered[1]*filtered[1])*frontend->gain;
+		if (magnitude>(0xffff<<8)) {
+			magnitude = 0xffff<<8;
+		}
+		edge = agc_sample(agc, (int32_t)magnitude);
+		if (edge>=0) {
+			if (levels) {
+				levels[nb] = edge ? agc->noise : agc->top;
+			}
+			edges[nb++] = ((uint32_t)outputs<<1)|edge;
+		}
+		outputs++;
+	}
+	*samples = outputs;
+	return nb;
+}
@@ -0,0 +1,80 @@
+#!/usr/bin/env ruby
+# encoding: utf-8
+# ruby: 2.1
+=begin
+this script prints the events published by decode.rb (see Publisher), with the latency between the publication and the reception
+use the shared memory name to follow the ring (decode.rb -s), this requires the native library (run make):
+  rtl_fm -f 317.962M -M am - | ./decode.rb -s /megacode -
+  ./events.rb /megacode
+or the unix socket path to connect to it (decode.rb -u):
+  rtl_fm -f 317.962M -M am - | ./decode.rb -u /tmp/megacode.sock -
+  ./events.rb /tmp/megacode.sock
+the events lost because this reader was too slow (overrun) are reported
+=end
+require 'fiddle'
+require 'socket'
+
+EVENT = "Q<q<q<L<S<CCel<S<CCL<" # struct megacode_event
+PRESS = 2 # MEGACODE_EVENT_PRESS
+EVENT_SIZE = 48
+POLL = 0.0001 # how long to wait for the next event in the ring, in seconds
+LIBRARY = File.join(File.dirname(File.expand_path(__FILE__)), "libmegacode.so")
+
+# print the event (like decode.rb), with the latency
+def print_event(data)
+  sequence, time, offset, value, code, facility, button, snr, channel, frames, confidence, kind, duration = data.unpack(EVENT)
+  latency = Process.clock_gettime(Process::CLOCK_REALTIME, :microsecond)-time
+  printf("- %s: 0X%06x, code: %05d, facility: %d, button: %d", kind==PRESS ? "press" : "value", value, code, facility, button)
+  printf(", snr: %.1fdB", snr) unless snr.nan?
+  if kind==PRESS then
+    printf(", frames: %d, duration: %.3fs", frames, duration/1000000.0)
+  elsif frames>0 then
+    printf(", frames: %d, confidence: %d%%", frames, confidence)
+  end
+  printf(", channel: %+dkHz", channel/1000) if channel!=0
+  printf(", sequence: %d, offset: %.3fs, latency: %dus\n", sequence, offset/1000000.0, latency)
+  return sequence
+end
+
+raise "provide the shared memory name (e.g. /megacode) or the unix socket path to read the events from" unless ARGV.size==1
+$stdout.sync = true
+lost = 0 # number of events lost
+begin
+  if File.socket? ARGV[0] then
+    last = nil # sequence of the previous event (the publisher disconnects the slow clients, but the client may connect late)
+    UNIXSocket.open(ARGV[0]) do |socket|
+      while data = socket.read(EVENT_SIZE) and data.bytesize==EVENT_SIZE do
+        sequence = print_event(data)
+        lost += sequence-last-1 if last
+        last = sequence
+      end
+    end
+    puts "# publisher disconnected"
+  else
+    raise "#{ARGV[0]} is not a unix socket, and the native library is required for the shared memory ring (run make)" unless File.exist? LIBRARY
+    library = Fiddle.dlopen(LIBRARY)
+    attach = Fiddle::Function.new(library["megacode_ring_attach"], [Fiddle::TYPE_VOIDP], Fiddle::TYPE_VOIDP)
+    read = Fiddle::Function.new(library["megacode_ring_read"], [Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP, Fiddle::TYPE_VOIDP], Fiddle::TYPE_INT)
+    ring = attach.call(ARGV[0])
+    raise "could not attach to shared memory ring #{ARGV[0]}" if ring.null?
+    ring.free = library["megacode_ring_close"]
+    cursor = Fiddle::Pointer.malloc(8, Fiddle::RUBY_FREE) # sequence of the next event
+    cursor[0, 8] = [0].pack("Q")
+    event = Fiddle::Pointer.malloc(EVENT_SIZE, Fiddle::RUBY_FREE)
+    loop do
+      expected = cursor[0, 8].unpack("Q")[0]
+      case read.call(ring, cursor, event)
+      when 1
+        print_event(event[0, EVENT_SIZE])
+      when 0
+        sleep POLL
+      else
+        skipped = cursor[0, 8].unpack("Q")[0]-expected
+        lost += skipped
+        puts "# overrun: #{skipped} events lost"
+      end
+    end
+  end
+rescue Interrupt
+end
+puts "# lost: #{lost}"
@@ -0,0 +1,110 @@
+/* example program embedding the MegaCode decoder library
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* decode the rtl_fm output (file, or the standard input if it is '-') with megacode_decoder_push and megacode_decoder_flush
+ * the frames are printed like the values of decode.rb (make check compares them)
+ * usage: frames [-a] [-p] [-r rate] file
+ * -a uses the adaptive threshold, -r sets the sample rate in Hz (24000 by default)
+ * -p decodes with the pipeline instead (megacode_pipeline_push and megacode_pipeline_flush), and prints the statistics of its queues on the standard error
+ * the samples are pushed in reads of odd length, to check that the decoding does not depend on how the samples are split
+ */
+/* libraries */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include "megacode.h"
+
+#define READ 1000 /* how many samples to read at once (not a multiple of the decoder block) */
+
+/* print the frame like decode.rb */
+static void print_frame(const struct megacode_frame* frame, void* context)
+{
+	(void)context;
+	printf("- value: 0X%06x, code: %05u, facility: %u, button: %u", (unsigned int)frame->value, (unsigned int)frame->code, (unsigned int)frame->facility, (unsigned int)frame->button);
+	if (!isnan(frame->snr)) {
+		printf(", snr: %.1fdB", frame->snr);
+	}
+	printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+	int adaptive = 0; /* use the adaptive threshold */
+	int pipelined = 0; /* use the pipeline */
+	unsigned int rate = 24000; /* sample rate, in Hz */
+	const char* path = NULL; /* file to decode */
+	FILE* file;
+	struct megacode_decoder* decoder = NULL;
+	struct megacode_pipeline* pipeline = NULL;
+	struct megacode_pipeline_stats stats;
+	static int16_t samples[READ];
+	size_t length;
+	int i;
+	for (i=1; i<argc; i++) {
+		if (!strcmp(argv[i], "-a")) {
+			adaptive = 1;
+		} else if (!strcmp(argv[i], "-p")) {
+			pipelined = 1;
+		} else if (!strcmp(argv[i], "-r") && i+1<argc) {
+			rate = strtoul(argv[++i], NULL, 10);
+		} else {
+			path = argv[i];
+		}
+	}
+	if (!path) {
+		fprintf(stderr, "usage: %s [-a] [-p] [-r rate] file\n", argv[0]);
+		return 1;
+	}
+	file = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if (!file) {
+		perror(path);
+		return 1;
+	}
+	if (pipelined) { /* the frames are printed by the output thread */
+		pipeline = megacode_pipeline_new(rate, adaptive, print_frame, NULL);
+	} else {
+		decoder = megacode_decoder_new(rate, adaptive, print_frame, NULL);
+	}
+	if (!decoder && !pipeline) {
+		fprintf(stderr, "could not create decoder\n");
+		return 1;
+	}
+	while ((length = fread(samples, sizeof(int16_t), READ, file))>0) { /* the samples are little endian, like the host */
+		if (pipeline) {
+			megacode_pipeline_push(pipeline, samples, length);
+		} else {
+			megacode_decoder_push(decoder, samples, length);
+		}
+	}
+	if (pipeline) {
+		megacode_pipeline_flush(pipeline);
+		megacode_pipeline_stats(pipeline, &stats);
+		fprintf(stderr, "# queue samples: %u slots, peak %u, %llu entries, %llu stalls\n", stats.samples.slots, stats.samples.peak, (unsigned long long)stats.samples.entries, (unsigned long long)stats.samples.stalls);
+		fprintf(stderr, "# queue edges: %u slots, peak %u, %llu entries, %llu stalls\n", stats.edges.slots, stats.edges.peak, (unsigned long long)stats.edges.entries, (unsigned long long)stats.edges.stalls);
+		fprintf(stderr, "# queue frames: %u slots, peak %u, %llu entries, %llu stalls\n", stats.frames.slots, stats.frames.peak, (unsigned long long)stats.frames.entries, (unsigned long long)stats.frames.stalls);
+		megacode_pipeline_free(pipeline);
+	} else {
+		megacode_decoder_flush(decoder);
+		megacode_decoder_free(decoder);
+	}
+	if (file!=stdin) {
+		fclose(file);
+	}
+	return 0;
+}
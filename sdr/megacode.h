@@ -0,0 +1,222 @@
+/* native functions for the MegaCode SDR decoder (see decode.rb)
+ * compile them using make, decode.rb uses them when the library is present
+ */
+#include <stddef.h>
+#include <stdint.h>
+
+/* detect the threshold crossings in the samples (little endian signed 16 bits integers)
+ * the signal is on after a sample above the threshold, and off after a sample below it (a sample equal to the threshold keeps the state)
+ * level is the state before the first sample, and is updated to the state after the last sample
+ * the edges are saved as (sample index << 1) | rising, the index being relative to the first sample
+ * edges must have space for length entries (at most one edge per sample), length must be below 2^31
+ * return the number of edges saved
+ */
+size_t megacode_edges(const int16_t* samples, size_t length, int16_t threshold, uint8_t* level, uint32_t* edges);
+
+/* the state of the adaptive threshold (all levels are unwrapped samples << 8)
+ * the noise floor and its deviation are averaged while the signal is off, the peak follows the pulses and decays slowly to the noise floor
+ * the threshold is between the noise floor and the peak, with hysteresis, and clearly above the noise
+ */
+struct megacode_agc {
+	int32_t noise; /* noise floor (negative until the first sample) */
+	int32_t deviation; /* mean deviation of the noise from the noise floor */
+	int32_t peak; /* peak level of the recent pulses */
+	int32_t level; /* is the signal on */
+	int32_t shift; /* log2 of the sample rate / 24kHz (between -4 and 8), the averaging and decay are this much slower at higher rates */
+	int32_t top; /* highest level of the current (or last) pulse */
+};
+
+/* detect the edges like megacode_edges, but using the adaptive threshold instead of a fixed one
+ * the AM envelope is never negative, the negative samples are strong signals which overflowed in the rtl_fm output, and are unwrapped
+ * if levels is not NULL, the level of every edge is saved in it: the noise floor before the pulse for a rising edge, the highest level of the pulse for a falling edge
+ */
+size_t megacode_edges_agc(const int16_t* samples, size_t length, struct megacode_agc* agc, uint32_t* edges, int32_t* levels);
+
+/* wideband channelizer: polyphase filterbank splitting a raw IQ recording (rtl_sdr output) in channels
+ * the channels are spaced by rate/channels, and decimated by channels
+ */
+struct megacode_channelizer;
+
+/* create a channelizer with the number of channels, and the prototype filter taps per channel (the longer the sharper)
+ * return NULL on error
+ */
+struct megacode_channelizer* megacode_channelizer_new(unsigned int channels, unsigned int taps);
+
+/* free the channelizer */
+void megacode_channelizer_free(struct megacode_channelizer* channelizer);
+
+/* filter the IQ samples (interleaved unsigned 8 bits I and Q, length is the number of IQ pairs)
+ * every channels IQ samples, the polyphase branches (channels complex floats, real first) are saved in branches
+ * branches must have space for length/channels+1 outputs, the samples left over are used in the next call
+ * return the number of outputs saved
+ */
+size_t megacode_channelize(struct megacode_channelizer* channelizer, const uint8_t* iq, size_t length, float* branches);
+
+/* compute the AM envelope of one channel from the polyphase branches (channel is the offset in channel spacing, can be negative)
+ * the envelope is saved as unsigned 16 bits (in samples), like rtl_fm it wraps to negative signed 16 bits integers
+ * the channels can be computed in parallel
+ */
+void megacode_channel(const float* branches, size_t frames, unsigned int channels, int channel, int16_t* samples);
+
+/* IQ front end: decode the raw IQ samples (rtl_sdr output) at the tuned frequency, without rtl_fm
+ * the DC offset is removed, the samples are decimated with a CIC filter, and the AM envelope is detected with the adaptive threshold, all in one pass
+ */
+struct megacode_frontend;
+
+/* create a front end decimating the IQ samples by decimation (the output sample rate is the IQ sample rate / decimation)
+ * return NULL on error (decimation is at most 11585, else the CIC filter overflows)
+ */
+struct megacode_frontend* megacode_frontend_new(unsigned int decimation);
+
+/* free the front end */
+void megacode_frontend_free(struct megacode_frontend* frontend);
+
+/* detect the edges in the IQ samples (interleaved unsigned 8 bits I and Q, length is the number of IQ pairs), like megacode_edges_agc
+ * the edge indexes are the output sample index relative to the first output, samples is set to the number of output samples
+ * edges (and levels if not NULL) must have space for length/decimation+1 entries, the samples left over are used in the next call
+ * return the number of edges saved
+ */
+size_t megacode_frontend_edges(struct megacode_frontend* frontend, const uint8_t* iq, size_t length, struct megacode_agc* agc, uint32_t* edges, int32_t* levels, size_t* samples);
+
+/* embeddable decoder: decode the frames from the rtl_fm output, like decode.rb
+ * all the state is in the decoder context, several decoders can be used in parallel (one thread per decoder)
+ */
+struct megacode_decoder;
+
+/* a decoded frame */
+struct megacode_frame {
+	uint32_t value; /* the 24 bits of the frame */
+	uint16_t code; /* the remote code (bits 3 to 18) */
+	uint8_t facility; /* the facility code (bits 19 to 22) */
+	uint8_t button; /* the button (bits 0 to 2) */
+	int64_t sample; /* index of the first pulse, since the beginning of the stream (divide by the sample rate for the time) */
+	float snr; /* signal to noise ratio of the transmission in dB: the highest level of its pulses over the noise floor before it (NAN with the fixed threshold, or if unknown) */
+};
+
+/* called for every decoded frame, with the context given to megacode_decoder_new (the frame is only valid during the call)
+ * the callback must not push samples to the decoder calling it
+ */
+typedef void (*megacode_frame_callback)(const struct megacode_frame* frame, void* context);
+
+/* create a decoder for samples at rate (in Hz), using the adaptive threshold (megacode_edges_agc) if adaptive is not 0, else the fixed one
+ * return NULL on error
+ */
+struct megacode_decoder* megacode_decoder_new(unsigned int rate, int adaptive, megacode_frame_callback callback, void* context);
+
+/* free the decoder */
+void megacode_decoder_free(struct megacode_decoder* decoder);
+
+/* decode the next samples (little endian signed 16 bits integers, any length), the samples are not copied
+ * return the number of frames reported (a frame is reported once its 24th pulse is complete, 1ms after it started)
+ */
+size_t megacode_decoder_push(struct megacode_decoder* decoder, const int16_t* samples, size_t length);
+
+/* end of the stream: report the frame which is still pending, and reset the decoder for the next stream
+ * return the number of frames reported
+ */
+size_t megacode_decoder_flush(struct megacode_decoder* decoder);
+
+/* discard the pending pulses and start a new stream (the sample index restarts at 0, and the threshold is adapted again) */
+void megacode_decoder_reset(struct megacode_decoder* decoder);
+
+/* decode the edges detected elsewhere in the next length samples, instead of pushing the samples (the edge detection state of the decoder is not used)
+ * the edges are from megacode_edges, megacode_edges_agc, or megacode_frontend_edges (levels can be NULL, the signal to noise ratio is then unknown)
+ * return the number of frames reported
+ */
+size_t megacode_decoder_edges(struct megacode_decoder* decoder, const uint32_t* edges, const int32_t* levels, size_t nb, size_t length);
+
+/* decoding pipeline: the decoder stages run in their own threads, for live streams which must not wait for the decoding or the output
+ * the pushed samples are copied in blocks to the sample ring, the edge thread detects their edges in the edge ring, the decoder thread decodes them in the frame ring, and the output thread calls the callback
+ * the rings are bounded, single producer and single consumer, and lock free while they are neither full nor empty (a thread only sleeps on a full or empty ring)
+ * a slow callback first fills the frame ring, the pushes are only held back once the rings before are full
+ */
+struct megacode_pipeline;
+
+/* the statistics of a ring between two stages */
+struct megacode_queue_stats {
+	uint32_t slots; /* how many entries the ring holds */
+	uint32_t depth; /* entries in the ring now */
+	uint32_t peak; /* most entries in the ring at once */
+	uint64_t entries; /* entries passed through the ring */
+	uint64_t stalls; /* how many times the producer waited for a free slot (back-pressure) */
+};
+
+/* the statistics of the rings between the stages */
+struct megacode_pipeline_stats {
+	struct megacode_queue_stats samples; /* blocks of samples, to the edge thread */
+	struct megacode_queue_stats edges; /* blocks of edges, to the decoder thread */
+	struct megacode_queue_stats frames; /* decoded frames, to the output thread */
+};
+
+/* create a pipeline decoding like megacode_decoder_new, and start its threads
+ * the callback is called from the output thread
+ * return NULL on error
+ */
+struct megacode_pipeline* megacode_pipeline_new(unsigned int rate, int adaptive, megacode_frame_callback callback, void* context);
+
+/* stop the threads once the pushed samples are decoded (without reporting the pending frame, flush before), and free the pipeline */
+void megacode_pipeline_free(struct megacode_pipeline* pipeline);
+
+/* queue the next samples (little endian signed 16 bits integers, any length), they are copied so the buffer can be reused on return
+ * the samples are copied in blocks of at most 4096 samples, a push only waits if the sample ring is full
+ */
+void megacode_pipeline_push(struct megacode_pipeline* pipeline, const int16_t* samples, size_t length);
+
+/* end of the stream: wait until all the pushed samples are decoded and their frames reported (also the pending one), and reset the decoder for the next stream */
+void megacode_pipeline_flush(struct megacode_pipeline* pipeline);
+
+/* get the statistics of the rings (they can be read from any thread while decoding) */
+void megacode_pipeline_stats(struct megacode_pipeline* pipeline, struct megacode_pipeline_stats* stats);
+
+/* decoded event, as published to the readers (fixed size, little endian on the usual hosts) */
+struct megacode_event {
+	uint64_t sequence; /* event number, starting at 1 (set when published) */
+	int64_t time; /* when the event was published, in microseconds since the epoch (set when published, to measure the latency) */
+	int64_t offset; /* start of the transmission in the capture, in microseconds */
+	uint32_t value; /* the 24 bits of the frame */
+	uint16_t code; /* the remote code (bits 3 to 18) */
+	uint8_t facility; /* the facility code (bits 19 to 22) */
+	uint8_t button; /* the button (bits 0 to 2) */
+	float snr; /* signal to noise ratio in dB (NAN if unknown) */
+	int32_t channel; /* channel offset in Hz (wideband decoding, else 0) */
+	uint16_t frames; /* number of frames combined in this code, or folded in this press (0 for a single frame) */
+	uint8_t confidence; /* confidence of the combined code, in percent */
+	uint8_t kind; /* MEGACODE_EVENT_VALUE, MEGACODE_EVENT_CODE, or MEGACODE_EVENT_PRESS */
+	uint32_t duration; /* time from the start of the first frame to the end (last pulse) of the last frame of the press, in microseconds (0 else) */
+};
+#define MEGACODE_EVENT_VALUE 0 /* a decoded frame */
+#define MEGACODE_EVENT_CODE 1 /* the frames of a burst combined in one code (decode.rb -c) */
+#define MEGACODE_EVENT_PRESS 2 /* the frames of a button press, the snr is the best one (decode.rb -b) */
+
+/* shared memory ring of events: one publisher, any number of readers without locks
+ * the events are kept until the publisher wraps around, readers which are too slow are overrun and skip the lost events
+ */
+struct megacode_ring;
+
+/* create the ring in shared memory (name as for shm_open, e.g. /megacode) for publishing, with a power of 2 number of slots
+ * a previous ring with the same name is replaced
+ * return NULL on error
+ */
+struct megacode_ring* megacode_ring_create(const char* name, unsigned int slots);
+
+/* attach to the ring created by the publisher, read only
+ * return NULL on error (also if the ring has not been created yet)
+ */
+struct megacode_ring* megacode_ring_attach(const char* name);
+
+/* detach from the ring (the publisher leaves the ring in shared memory, for the readers) */
+void megacode_ring_close(struct megacode_ring* ring);
+
+/* publish the event (the sequence and time are set)
+ * return the sequence of the event (0 if the ring is not writable)
+ */
+uint64_t megacode_ring_publish(struct megacode_ring* ring, struct megacode_event* event);
+
+/* return the sequence of the last event published (0 if none) */
+uint64_t megacode_ring_head(const struct megacode_ring* ring);
+
+/* read the event with sequence next (use 0 to start with the next event published), and increment next
+ * return 1 if the event has been read, 0 if it has not been published yet
+ * return -1 if the reader has been overrun: next is set to the oldest event left, the events in between are lost
+ */
+int megacode_ring_read(const struct megacode_ring* ring, uint64_t* next, struct megacode_event* event);
@@ -0,0 +1,410 @@
+/* multi-threaded decoding pipeline for the MegaCode SDR decoder
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* the stages of the decoder (see decoder.c) run in their own threads:
+ * - the caller pushes the samples, they are copied in blocks to the sample queue
+ * - the edge thread detects the edges of every block (megacode_edges or megacode_edges_agc), directly in a slot of the edge queue
+ * - the decoder thread merges the edges in pulses and groups, and decodes the frames (megacode_decoder_edges) to the frame queue
+ * - the output thread calls the callback for every frame
+ * every queue is a bounded ring with a single producer and a single consumer: the producer only writes the head, the consumer only the tail
+ * a thread only sleeps (on the queue condition) when its queue is empty or full, else the queues are lock free
+ * the end of a stream and the end of the threads are markers passed through the queues, in order with the samples
+ */
+/* libraries */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <math.h>
+#include "megacode.h"
+
+/* pipeline parameters */
+#define PIPELINE_RATE 24000 /* sample rate the adaptive threshold is tuned for, in Hz (see decoder.c) */
+#define PIPELINE_THRESHOLD 16384 /* fixed threshold (see decoder.c) */
+#define PIPELINE_BLOCK 4096 /* samples per block */
+#define PIPELINE_SAMPLES 64 /* blocks in the sample queue (11s at 24kHz) */
+#define PIPELINE_EDGES 16 /* blocks in the edge queue */
+#define PIPELINE_FRAMES 256 /* frames in the frame queue */
+
+/* what an entry of the queues is */
+enum pipeline_kind {
+	PIPELINE_DATA, /* samples, edges, or a frame */
+	PIPELINE_FLUSH, /* end of the stream */
+	PIPELINE_STOP, /* end of the thread */
+};
+
+/* bounded single producer single consumer ring */
+struct queue {
+	unsigned char* slots; /* the entries */
+	size_t size; /* size of an entry, in bytes */
+	uint32_t number; /* number of entries (power of 2) */
+	_Atomic uint64_t head; /* entries written (only written by the producer) */
+	_Atomic uint64_t tail; /* entries read (only written by the consumer) */
+	_Atomic uint32_t waiting; /* threads sleeping on the condition */
+	pthread_mutex_t lock; /* only used to sleep */
+	pthread_cond_t cond; /* signaled when an entry is written or read while a thread is sleeping */
+	_Atomic uint32_t peak; /* most entries in the queue at once */
+	_Atomic uint64_t stalls; /* how many times the producer waited for a free slot */
+};
+
+/* a block of samples */
+struct pipeline_samples {
+	enum pipeline_kind kind;
+	size_t length; /* number of samples */
+	int16_t samples[PIPELINE_BLOCK];
+};
+
+/* the edges of a block of samples */
+struct pipeline_edges {
+	enum pipeline_kind kind;
+	size_t length; /* number of samples */
+	size_t nb; /* number of edges */
+	uint32_t edges[PIPELINE_BLOCK];
+	int32_t levels[PIPELINE_BLOCK];
+};
+
+/* a decoded frame */
+struct pipeline_frame {
+	enum pipeline_kind kind;
+	struct megacode_frame frame;
+};
+
+struct megacode_pipeline {
+	megacode_frame_callback callback; /* called for every decoded frame */
+	void* context; /* passed to the callback */
+	int adaptive; /* use the adaptive threshold instead of the fixed one */
+	int32_t shift; /* adaptive threshold rate shift (see struct megacode_agc) */
+	struct megacode_decoder* decoder; /* only used by the decoder thread */
+	struct queue samples; /* caller to edge thread */
+	struct queue edges; /* edge thread to decoder thread */
+	struct queue frames; /* decoder thread to output thread */
+	pthread_t threads[3]; /* edge, decoder, and output threads */
+	unsigned int started; /* number of threads started */
+	pthread_mutex_t lock; /* protects flushed */
+	pthread_cond_t flush; /* signaled when a flush marker has been output */
+	uint64_t flushes; /* flush markers pushed (only used by the caller) */
+	uint64_t flushed; /* flush markers output */
+};
+
+/* allocate the queue entries, return 0 on success */
+static int queue_init(struct queue* queue, size_t size, uint32_t number)
+{
+	queue->slots = calloc(number, size);
+	if (!queue->slots) {
+		return -1;
+	}
+	queue->size = size;
+	queue->number = number;
+	atomic_init(&queue->head, 0);
+	atomic_init(&queue->tail, 0);
+	atomic_init(&queue->waiting, 0);
+	atomic_init(&queue->peak, 0);
+	atomic_init(&queue->stalls, 0);
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+	return 0;
+}
+
+static void queue_free(struct queue* queue)
+{
+	if (queue->slots) {
+		pthread_mutex_destroy(&queue->lock);
+		pthread_cond_destroy(&queue->cond);
+		free(queue->slots);
+		queue->slots = NULL;
+	}
+}
+
+/* sleep until the queue is not full (wait_full) or not empty (else)
+ * the sleeper counts itself in waiting before checking the queue again, and the other side checks waiting after moving its index (both sequentially consistent)
+ * so either the sleeper sees the index moved, or the other side sees the sleeper and wakes it up
+ */
+static void queue_wait(struct queue* queue, int wait_full)
+{
+	pthread_mutex_lock(&queue->lock);
+	atomic_fetch_add(&queue->waiting, 1);
+	for (;;) {
+		uint64_t used = atomic_load(&queue->head)-atomic_load(&queue->tail);
+		if (wait_full ? used<queue->number : used>0) {
+			break;
+		}
+		pthread_cond_wait(&queue->cond, &queue->lock);
+	}
+	atomic_fetch_sub(&queue->waiting, 1);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+/* wake up the thread sleeping on the queue, if any */
+static void queue_wake(struct queue* queue)
+{
+	if (atomic_load(&queue->waiting)) {
+		pthread_mutex_lock(&queue->lock);
+		pthread_cond_broadcast(&queue->cond);
+		pthread_mutex_unlock(&queue->lock);
+	}
+}
+
+/* return the next free entry to write (producer), wait if the queue is full */
+static void* queue_slot(struct queue* queue)
+{
+	uint64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+	if (head-atomic_load_explicit(&queue->tail, memory_order_acquire)>=queue->number) { /* back-pressure */
+		atomic_fetch_add_explicit(&queue->stalls, 1, memory_order_relaxed);
+		queue_wait(queue, 1);
+	}
+	return queue->slots+(head&(queue->number-1))*queue->size;
+}
+
+/* publish the entry returned by queue_slot (producer) */
+static void queue_commit(struct queue* queue)
+{
+	uint64_t head = atomic_load_explicit(&queue->head, memory_order_relaxed)+1;
+	uint32_t depth = head-atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if (depth>atomic_load_explicit(&queue->peak, memory_order_relaxed)) {
+		atomic_store_explicit(&queue->peak, depth, memory_order_relaxed);
+	}
+	atomic_store(&queue->head, head);
+	queue_wake(queue);
+}
+
+/* return the next entry to read (consumer), wait if the queue is empty */
+static void* queue_next(struct queue* queue)
+{
+	uint64_t tail = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	if (atomic_load_explicit(&queue->head, memory_order_acquire)==tail) {
+		queue_wait(queue, 0);
+	}
+	return queue->slots+(tail&(queue->number-1))*queue->size;
+}
+
+/* free the entry returned by queue_next (consumer) */
+static void queue_release(struct queue* queue)
+{
+	atomic_store(&queue->tail, atomic_load_explicit(&queue->tail, memory_order_relaxed)+1);
+	queue_wake(queue);
+}
+
+static void queue_stats(struct queue* queue, struct megacode_queue_stats* stats)
+{
+	uint64_t tail = atomic_load(&queue->tail);
+	uint64_t head = atomic_load(&queue->head);
+	stats->slots = queue->number;
+	stats->depth = head>tail ? head-tail : 0;
+	stats->peak = atomic_load_explicit(&queue->peak, memory_order_relaxed);
+	stats->entries = tail;
+	stats->stalls = atomic_load_explicit(&queue->stalls, memory_order_relaxed);
+}
+
+/* edge thread: detect the edges of the sample blocks */
+static void* edge_thread(void* argument)
+{
+	struct megacode_pipeline* pipeline = argument;
+	uint8_t level = 0; /* fixed threshold state between the blocks */
+	struct megacode_agc agc = {-1, 0, 0, 0, pipeline->shift, 0}; /* adaptive threshold state */
+	struct pipeline_samples* block;
+	struct pipeline_edges* edges;
+	enum pipeline_kind kind;
+	do {
+		block = queue_next(&pipeline->samples);
+		kind = block->kind;
+		edges = queue_slot(&pipeline->edges);
+		edges->kind = kind;
+		edges->length = 0;
+		edges->nb = 0;
+		if (kind==PIPELINE_DATA) {
+			edges->length = block->length;
+			if (pipeline->adaptive) {
+				edges->nb = megacode_edges_agc(block->samples, block->length, &agc, edges->edges, edges->levels);
+			} else {
+				edges->nb = megacode_edges(block->samples, block->length, PIPELINE_THRESHOLD, &level, edges->edges);
+			}
+		} else if (kind==PIPELINE_FLUSH) { /* the threshold is adapted again for the next stream */
+			level = 0;
+			agc.noise = -1;
+			agc.deviation = 0;
+			agc.peak = 0;
+			agc.level = 0;
+			agc.top = 0;
+		}
+		queue_commit(&pipeline->edges);
+		queue_release(&pipeline->samples);
+	} while (kind!=PIPELINE_STOP);
+	return NULL;
+}
+
+/* decoder callback: queue the frame for the output thread */
+static void queue_frame(const struct megacode_frame* frame, void* context)
+{
+	struct megacode_pipeline* pipeline = context;
+	struct pipeline_frame* output = queue_slot(&pipeline->frames);
+	output->kind = PIPELINE_DATA;
+	output->frame = *frame;
+	queue_commit(&pipeline->frames);
+}
+
+/* decoder thread: decode the edges in frames */
+static void* decoder_thread(void* argument)
+{
+	struct megacode_pipeline* pipeline = argument;
+	struct pipeline_edges* edges;
+	struct pipeline_frame* output;
+	enum pipeline_kind kind;
+	do {
+		edges = queue_next(&pipeline->edges);
+		kind = edges->kind;
+		if (kind==PIPELINE_DATA) {
+			megacode_decoder_edges(pipeline->decoder, edges->edges, pipeline->adaptive ? edges->levels : NULL, edges->nb, edges->length);
+		} else {
+			if (kind==PIPELINE_FLUSH) { /* report the pending frame */
+				megacode_decoder_flush(pipeline->decoder);
+			}
+			output = queue_slot(&pipeline->frames);
+			output->kind = kind;
+			queue_commit(&pipeline->frames);
+		}
+		queue_release(&pipeline->edges);
+	} while (kind!=PIPELINE_STOP);
+	return NULL;
+}
+
+/* output thread: call the callback for every frame */
+static void* output_thread(void* argument)
+{
+	struct megacode_pipeline* pipeline = argument;
+	struct pipeline_frame* output;
+	enum pipeline_kind kind;
+	do {
+		output = queue_next(&pipeline->frames);
+		kind = output->kind;
+		if (kind==PIPELINE_DATA) {
+			pipeline->callback(&output->frame, pipeline->context);
+		}
+		queue_release(&pipeline->frames);
+		if (kind==PIPELINE_FLUSH) { /* all the frames of the stream have been reported */
+			pthread_mutex_lock(&pipeline->lock);
+			pipeline->flushed++;
+			pthread_cond_broadcast(&pipeline->flush);
+			pthread_mutex_unlock(&pipeline->lock);
+		}
+	} while (kind!=PIPELINE_STOP);
+	return NULL;
+}
+
+/* queue a marker after the samples */
+static void push_marker(struct megacode_pipeline* pipeline, enum pipeline_kind kind)
+{
+	struct pipeline_samples* block = queue_slot(&pipeline->samples);
+	block->kind = kind;
+	block->length = 0;
+	queue_commit(&pipeline->samples);
+}
+
+/* stop the started threads and free everything */
+static void destroy(struct megacode_pipeline* pipeline)
+{
+	unsigned int i;
+	if (pipeline->started) {
+		push_marker(pipeline, PIPELINE_STOP);
+		for (i=0; i<pipeline->started; i++) {
+			pthread_join(pipeline->threads[i], NULL);
+		}
+	}
+	queue_free(&pipeline->samples);
+	queue_free(&pipeline->edges);
+	queue_free(&pipeline->frames);
+	pthread_mutex_destroy(&pipeline->lock);
+	pthread_cond_destroy(&pipeline->flush);
+	megacode_decoder_free(pipeline->decoder);
+	free(pipeline);
+}
+
+struct megacode_pipeline* megacode_pipeline_new(unsigned int rate, int adaptive, megacode_frame_callback callback, void* context)
+{
+	struct megacode_pipeline* pipeline;
+	void* (*threads[3])(void*) = {edge_thread, decoder_thread, output_thread};
+	int shift;
+	unsigned int i;
+	if (rate==0 || !callback) {
+		return NULL;
+	}
+	pipeline = calloc(1, sizeof(struct megacode_pipeline));
+	if (!pipeline) {
+		return NULL;
+	}
+	pipeline->callback = callback;
+	pipeline->context = context;
+	pipeline->adaptive = adaptive;
+	shift = lround(log2((double)rate/PIPELINE_RATE));
+	pipeline->shift = shift<-4 ? -4 : (shift>8 ? 8 : shift);
+	pthread_mutex_init(&pipeline->lock, NULL);
+	pthread_cond_init(&pipeline->flush, NULL);
+	pipeline->decoder = megacode_decoder_new(rate, adaptive, queue_frame, pipeline);
+	if (!pipeline->decoder ||
+	    queue_init(&pipeline->samples, sizeof(struct pipeline_samples), PIPELINE_SAMPLES) ||
+	    queue_init(&pipeline->edges, sizeof(struct pipeline_edges), PIPELINE_EDGES) ||
+	    queue_init(&pipeline->frames, sizeof(struct pipeline_frame), PIPELINE_FRAMES)) {
+		destroy(pipeline);
+		return NULL;
+	}
+	for (i=0; i<3; i++) {
+		if (pthread_create(&pipeline->threads[i], NULL, threads[i], pipeline)) {
+			destroy(pipeline); /* the stop marker ends the threads started */
+			return NULL;
+		}
+		pipeline->started++;
+	}
+	return pipeline;
+}
+
+void megacode_pipeline_free(struct megacode_pipeline* pipeline)
+{
+	destroy(pipeline);
+}
+
+void megacode_pipeline_push(struct megacode_pipeline* pipeline, const int16_t* samples, size_t length)
+{
+	struct pipeline_samples* block;
+	size_t i, block_length;
+	for (i=0; i<length; i+=block_length) {
+		block_length = length-i<PIPELINE_BLOCK ? length-i : PIPELINE_BLOCK;
+		block = queue_slot(&pipeline->samples);
+		block->kind = PIPELINE_DATA;
+		block->length = block_length;
+		memcpy(block->samples, samples+i, block_length*sizeof(int16_t));
+		queue_commit(&pipeline->samples);
+	}
+}
+
+void megacode_pipeline_flush(struct megacode_pipeline* pipeline)
+{
+	push_marker(pipeline, PIPELINE_FLUSH);
+	pipeline->flushes++;
+	pthread_mutex_lock(&pipeline->lock);
+	while (pipeline->flushed<pipeline->flushes) {
+		pthread_cond_wait(&pipeline->flush, &pipeline->lock);
+	}
+	pthread_mutex_unlock(&pipeline->lock);
+}
+
+void megacode_pipeline_stats(struct megacode_pipeline* pipeline, struct megacode_pipeline_stats* stats)
+{
+	queue_stats(&pipeline->samples, &stats->samples);
+	queue_stats(&pipeline->edges, &stats->edges);
+	queue_stats(&pipeline->frames, &stats->frames);
+}
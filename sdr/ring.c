@@ -0,0 +1,207 @@
+/* shared memory event ring for the MegaCode SDR decoder
+   Copyright (C) 2014 Kévin Redon <kingkevin@cuvoodoo.info>
+
+   This program is free software; you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation; either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software Foundation,
+   Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301  USA
+ */
+/* one publisher writes the events in a ring of slots in shared memory, any number of readers follow it without locks
+ * every slot is a sequence lock: the slot sequence is cleared while the event is written, and set to the event sequence once it is complete
+ * a reader copies the event, and checks the slot sequence before and after the copy: if it changed the publisher overwrote the slot, and the reader has been overrun
+ * the readers never write to the shared memory, so they do not slow down the publisher or each other
+ */
+/* libraries */
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "megacode.h"
+
+#define RING_MAGIC 0x4d474352 /* "MGCR" */
+#define RING_VERSION 1
+
+/* a slot of the ring */
+struct ring_slot {
+	_Atomic uint64_t sequence; /* sequence of the event in the slot, 0 while it is written */
+	struct megacode_event event;
+};
+
+/* the shared memory: the header followed by the slots */
+struct ring_header {
+	uint32_t magic; /* RING_MAGIC, set once the ring is initialized */
+	uint32_t version; /* RING_VERSION */
+	uint32_t slots; /* number of slots (power of 2) */
+	uint32_t size; /* size of an event, in bytes */
+	_Atomic uint64_t head; /* sequence of the last event published (0 if none) */
+	struct ring_slot slot[];
+};
+
+struct megacode_ring {
+	struct ring_header* header; /* the shared memory */
+	size_t length; /* size of the shared memory, in bytes */
+	uint64_t mask; /* slots-1 */
+	int writable; /* is this the publisher */
+};
+
+/* map the shared memory, return NULL on error */
+static struct megacode_ring* ring_map(int fd, size_t length, int writable)
+{
+	struct megacode_ring* ring;
+	void* memory;
+	memory = mmap(NULL, length, writable ? PROT_READ|PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	if (memory==MAP_FAILED) {
+		return NULL;
+	}
+	ring = calloc(1, sizeof(struct megacode_ring));
+	if (!ring) {
+		munmap(memory, length);
+		return NULL;
+	}
+	ring->header = memory;
+	ring->length = length;
+	ring->writable = writable;
+	return ring;
+}
+
+struct megacode_ring* megacode_ring_create(const char* name, unsigned int slots)
+{
+	struct megacode_ring* ring;
+	size_t length;
+	int fd;
+	if (slots==0 || (slots&(slots-1))) { /* the sequence is mapped to the slot with a mask */
+		return NULL;
+	}
+	length = sizeof(struct ring_header)+(size_t)slots*sizeof(struct ring_slot);
+	shm_unlink(name); /* the readers attached to a previous ring keep the old one, they have to attach again */
+	fd = shm_open(name, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd<0) {
+		return NULL;
+	}
+	if (ftruncate(fd, length)<0) { /* the new memory is zeroed: no event, and all slots empty */
+		close(fd);
+		shm_unlink(name);
+		return NULL;
+	}
+	ring = ring_map(fd, length, 1);
+	close(fd);
+	if (!ring) {
+		shm_unlink(name);
+		return NULL;
+	}
+	ring->mask = slots-1;
+	ring->header->version = RING_VERSION;
+	ring->header->slots = slots;
+	ring->header->size = sizeof(struct megacode_event);
+	atomic_store_explicit(&ring->header->head, 0, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	ring->header->magic = RING_MAGIC; /* the readers check it last */
+	return ring;
+}
+
+struct megacode_ring* megacode_ring_attach(const char* name)
+{
+	struct megacode_ring* ring;
+	struct stat status;
+	struct ring_header* header;
+	int fd;
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd<0) {
+		return NULL;
+	}
+	if (fstat(fd, &status)<0 || (size_t)status.st_size<sizeof(struct ring_header)) {
+		close(fd);
+		return NULL;
+	}
+	ring = ring_map(fd, status.st_size, 0);
+	close(fd);
+	if (!ring) {
+		return NULL;
+	}
+	header = ring->header;
+	if (header->magic!=RING_MAGIC || header->version!=RING_VERSION || header->size!=sizeof(struct megacode_event) || header->slots==0 || sizeof(struct ring_header)+(size_t)header->slots*sizeof(struct ring_slot)>ring->length) {
+		megacode_ring_close(ring);
+		return NULL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	ring->mask = header->slots-1;
+	return ring;
+}
+
+void megacode_ring_close(struct megacode_ring* ring)
+{
+	if (ring) {
+		munmap(ring->header, ring->length);
+		free(ring);
+	}
+}
+
+uint64_t megacode_ring_publish(struct megacode_ring* ring, struct megacode_event* event)
+{
+	struct timespec now;
+	struct ring_slot* slot;
+	uint64_t sequence;
+	if (!ring->writable) {
+		return 0;
+	}
+	sequence = atomic_load_explicit(&ring->header->head, memory_order_relaxed)+1;
+	clock_gettime(CLOCK_REALTIME, &now);
+	event->sequence = sequence;
+	event->time = (int64_t)now.tv_sec*1000000+now.tv_nsec/1000;
+	slot = &ring->header->slot[(sequence-1)&ring->mask];
+	atomic_store_explicit(&slot->sequence, 0, memory_order_relaxed); /* the slot is being written */
+	atomic_thread_fence(memory_order_release);
+	memcpy(&slot->event, event, sizeof(struct megacode_event));
+	atomic_store_explicit(&slot->sequence, sequence, memory_order_release);
+	atomic_store_explicit(&ring->header->head, sequence, memory_order_release);
+	return sequence;
+}
+
+uint64_t megacode_ring_head(const struct megacode_ring* ring)
+{
+	return atomic_load_explicit(&ring->header->head, memory_order_acquire);
+}
+
+int megacode_ring_read(const struct megacode_ring* ring, uint64_t* next, struct megacode_event* event)
+{
+	struct ring_slot* slot;
+	uint64_t head, before, after;
+	head = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+	if (*next==0) { /* start with the next event */
+		*next = head+1;
+	}
+	if (*next>head) { /* not published yet */
+		return 0;
+	}
+	if (head-*next>ring->mask) { /* the slot has already been reused */
+		*next = head-ring->mask;
+		return -1;
+	}
+	slot = &ring->header->slot[(*next-1)&ring->mask];
+	before = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+	memcpy(event, &slot->event, sizeof(struct megacode_event));
+	atomic_thread_fence(memory_order_acquire);
+	after = atomic_load_explicit(&slot->sequence, memory_order_relaxed);
+	if (before!=*next || after!=*next) { /* the publisher wrote the slot while copying it */
+		head = atomic_load_explicit(&ring->header->head, memory_order_acquire);
+		*next = head>ring->mask ? head-ring->mask : 1;
+		return -1;
+	}
+	(*next)++;
+	return 1;
+}
@@ -0,0 +1,303 @@
+#!/usr/bin/env ruby
+# encoding: utf-8
+# ruby: 2.1
+=begin
+this script queries the store of decoded values written by decode.rb (use -e to append the values to it):
+  rtl_fm -f 317.962M -M am - | ./decode.rb -e events -
+every press of a remote code in a time range, or all the activity of a facility:
+  ./store.rb events --code 46013 --from 2026-09-01 --to 2026-10-01
+  ./store.rb events --facility 9 --from "2026-09-12 08:00" --to "2026-09-12 18:00"
+use --count to only count the events (this does not read them), without query the store summary is printed
+the events in the time range are found with a binary search in the time column, and the ones of the code or facility with a binary search in its index
+so a query only reads the matching events, whatever the size of the store
+=end
+require 'time'
+require 'fileutils'
+
+# append-only store of the decoded values, in a directory
+# every field is in its own column file, with fixed size records (the row number is the index in the files):
+# - time: when the transmission started, in microseconds since the epoch (signed 64 bits)
+# - value: the 24 bits of the frame (3 bytes)
+# - source: the capture source (unsigned 16 bits, the line in the sources file)
+# - quality: the signal to noise ratio in 0.5dB steps (unsigned 8 bits, UNKNOWN without adaptive threshold)
+# the rows are indexed by remote code (code/NNNNN) and by facility (facility/NN): the rows of every key (unsigned 32 bits) in a file
+# the events are appended in time order, so the time column and the indexes are sorted
+# the events are kept DISORDER before being written, to sort the ones appended slightly out of order
+# there is one writer, the readers can query the store while it is written (the time column is written last and tells how many events are complete)
+class EventStore
+  COLUMNS = {value: 3, source: 2, quality: 1, time: 8} # column record sizes, in the order they are written
+  ROW = 4 # size of a row number in the indexes
+  UNKNOWN = 255 # quality of the values without signal to noise ratio
+  FLUSH = 4096 # how many events to buffer before writing them
+  DISORDER = 1000000 # how long the events are kept to sort them (in us, the wideband channels are decoded a block apart)
+  attr_reader :count # number of events
+  attr_accessor :sync # write every event immediately (like IO#sync)
+
+  # open the store in the directory, create it if writable
+  def initialize(path, writable = false)
+    @path = path
+    @writable = writable
+    if @writable then
+      FileUtils.mkdir_p([File.join(@path, "code"), File.join(@path, "facility")])
+      COLUMNS.each_key { |column| FileUtils.touch(file(column)) }
+      FileUtils.touch(File.join(@path, "sources"))
+    elsif !File.exist?(file(:time)) then
+      raise "#{path} is not an event store"
+    end
+    @count = File.size(file(:time))/COLUMNS[:time]
+    @sources = File.read(File.join(@path, "sources")).split("\n")
+    @written = @sources.size # number of sources in the sources file
+    @last = @count>0 ? time(@count-1) : nil # time of the last event in time order (written or buffered)
+    repair if @writable
+    @pending = [] # the events which can still be reordered, sorted by time
+    @newest = nil # time of the newest event appended (in us)
+    @buffer = [] # the events in time order not written yet
+    @sync = false
+  end
+
+  # append an event: [time (in us since the epoch), value, source (name of the capture), signal to noise ratio (in dB, nil if unknown)]
+  # the event is only written once the events are DISORDER newer (see advance), or on flush
+  def <<(event)
+    time, value, source, snr = event
+    raise "event at #{Time.at(time/1000000.0)} is older than the last one stored (#{Time.at(@last/1000000.0)}), the events must be stored in time order (within #{DISORDER/1000}ms)" if @last and time<@last
+    id = @sources.index(source)
+    unless id then # the new sources are written with the events
+      raise "too many sources" if @sources.size>0xffff
+      id = @sources.size
+      @sources << source
+    end
+    quality = snr ? [[(snr*2).round, 0].max, UNKNOWN-1].min : UNKNOWN
+    index = @pending.bsearch_index { |other| other[0]>time } || @pending.size # after the events at the same time
+    @pending.insert(index, [time, value & 0xffffff, id, quality])
+    advance(time)
+    self
+  end
+
+  # the events up to the time (in us) have been appended: write the ones which can not be reordered anymore (older than DISORDER)
+  def advance(time)
+    @newest = time if !@newest or time>@newest
+    ready = @pending.index { |event| event[0]>@newest-DISORDER } || @pending.size
+    if ready>0 then
+      @buffer.concat(@pending.shift(ready))
+      @last = @buffer[-1][0]
+    end
+    write if @sync or @buffer.size>=FLUSH
+  end
+
+  # write all the events (the events appended afterwards must not be older)
+  def flush
+    unless @pending.empty? then
+      @buffer.concat(@pending)
+      @last = @pending[-1][0]
+      @pending = []
+    end
+    write
+  end
+
+  # return the number of events of the code or facility (all if none) in the time range (in us, to is excluded, nil for no limit)
+  def count_of(code: nil, facility: nil, from: nil, to: nil)
+    first, last = range(from, to)
+    return last-first if !code and !facility
+    if code and facility then # the facility is checked in the values
+      count = 0
+      each(code: code, facility: facility, from: from, to: to) { count += 1 }
+      return count
+    end
+    index, key = code ? ["code", code] : ["facility", facility]
+    return 0 unless File.exist?(index_file(index, key))
+    File.open(index_file(index, key), "rb") do |f|
+      size = f.size/ROW
+      return lower(f, size, last)-lower(f, size, first)
+    end
+  end
+
+  # yield the events of the code and/or facility (all if none) in the time range (in us, to is excluded, nil for no limit)
+  # the events are yielded as [time (in us), value, source, signal to noise ratio (nil if unknown)]
+  def each(code: nil, facility: nil, from: nil, to: nil)
+    first, last = range(from, to)
+    columns = COLUMNS.keys.collect { |column| [column, File.open(file(column), "rb")] }.to_h
+    begin
+      if code or facility then
+        index, key = code ? ["code", code] : ["facility", facility]
+        return unless File.exist?(index_file(index, key))
+        File.open(index_file(index, key), "rb") do |f|
+          start = lower(f, f.size/ROW, first)
+          stop = lower(f, f.size/ROW, last)
+          while start<stop do # read the rows in blocks
+            rows = f.pread([stop-start, FLUSH].min*ROW, start*ROW).unpack("L<*")
+            start += rows.size
+            rows.each do |row|
+              event = read(columns, row, 1)[0]
+              yield event if !facility or (event[1] >> 19) & 15==facility
+            end
+          end
+        end
+      else
+        while first<last do # read the consecutive rows in blocks
+          events = read(columns, first, [last-first, FLUSH].min)
+          first += events.size
+          events.each { |event| yield event }
+        end
+      end
+    ensure
+      columns.each_value(&:close)
+    end
+  end
+
+  # time of the first event (in us, nil if the store is empty)
+  def first
+    @count>0 ? time(0) : nil
+  end
+
+  # time of the last event (in us, nil if the store is empty)
+  def last
+    @count>0 ? time(@count-1) : nil
+  end
+
+  # the sources names
+  def sources
+    @sources.dup
+  end
+
+  # total size of the files, in bytes
+  def size
+    Dir.glob(File.join(@path, "**", "*")).select { |f| File.file?(f) }.inject(0) { |sum, f| sum+File.size(f) }
+  end
+
+  private
+
+  # write the buffered events (the new sources and the indexes first, the time column last)
+  def write
+    return if @buffer.empty?
+    if @sources.size>@written then
+      File.open(File.join(@path, "sources"), "a") { |f| f.puts(@sources[@written..-1]) }
+      @written = @sources.size
+    end
+    rows = {"code" => Hash.new { |h, k| h[k] = [] }, "facility" => Hash.new { |h, k| h[k] = [] }}
+    @buffer.each_with_index do |(time, value, source, quality), i|
+      rows["code"][(value >> 3) & 65535] << @count+i
+      rows["facility"][(value >> 19) & 15] << @count+i
+    end
+    rows.each do |index, keys|
+      keys.each do |key, list|
+        File.open(index_file(index, key), "ab") { |f| f.write(list.pack("L<*")) }
+      end
+    end
+    columns = {
+      value: @buffer.collect { |event| [event[1]].pack("L<")[0, 3] }.join,
+      source: @buffer.collect { |event| event[2] }.pack("S<*"),
+      quality: @buffer.collect { |event| event[3] }.pack("C*"),
+      time: @buffer.collect { |event| event[0] }.pack("q<*"),
+    }
+    COLUMNS.each_key do |column|
+      File.open(file(column), "ab") { |f| f.write(columns[column]) }
+    end
+    @count += @buffer.size
+    @buffer = []
+  end
+
+  def file(column)
+    File.join(@path, column.to_s)
+  end
+
+  def index_file(index, key)
+    File.join(@path, index, index=="code" ? format("%05d", key) : format("%02d", key))
+  end
+
+  # time of the event in the row (in us)
+  def time(row)
+    File.open(file(:time), "rb") { |f| f.pread(COLUMNS[:time], row*COLUMNS[:time]).unpack("q<")[0] }
+  end
+
+  # return the rows of the events in the time range (first row, and row after the last)
+  def range(from, to)
+    File.open(file(:time), "rb") do |f|
+      at = lambda do |time| # first row at or after the time
+        return @count unless time
+        (0...@count).bsearch { |row| f.pread(8, row*8).unpack("q<")[0]>=time } || @count
+      end
+      first = from ? at.call(from) : 0
+      last = to ? at.call(to) : @count
+      return first, [first, last].max
+    end
+  end
+
+  # return the position of the first row at or after row in the sorted index file with size rows
+  def lower(f, size, row)
+    (0...size).bsearch { |i| f.pread(ROW, i*ROW).unpack("L<")[0]>=row } || size
+  end
+
+  # read number events from the row in the open column files
+  def read(columns, row, number)
+    values = columns[:value].pread(number*3, row*3).bytes.each_slice(3).collect { |b0, b1, b2| b0|(b1 << 8)|(b2 << 16) }
+    sources = columns[:source].pread(number*2, row*2).unpack("S<*")
+    qualities = columns[:quality].pread(number, row).unpack("C*")
+    times = columns[:time].pread(number*8, row*8).unpack("q<*")
+    times.each_index.collect do |i|
+      [times[i], values[i], @sources[sources[i]], qualities[i]==UNKNOWN ? nil : qualities[i]/2.0]
+    end
+  end
+
+  # remove the parts of an interrupted write: the rows after the last complete one (the time column is written last)
+  # the indexes are written first, so they can have rows after it even if the columns are consistent
+  def repair
+    COLUMNS.each { |column, size| File.truncate(file(column), @count*size) if File.size(file(column))!=@count*size }
+    Dir.glob(File.join(@path, "{code,facility}", "*")).each do |index|
+      File.open(index, "r+b") do |f|
+        size = f.size/ROW
+        f.truncate(lower(f, size, @count)*ROW)
+      end
+    end
+  end
+end
+
+if __FILE__==$0 then
+  # parse a time (in the local time zone if not given), return it in us
+  def parse_time(text)
+    (Time.parse(text).to_r*1000000).to_i
+  rescue ArgumentError
+    raise "can not parse time #{text} (e.g. 2026-09-01 or \"2026-09-12 08:00\")"
+  end
+
+  # format a time in us
+  def format_time(time)
+    Time.at(time/1000000, time%1000000).strftime("%Y-%m-%d %H:%M:%S.%L")
+  end
+
+  options = {}
+  count = !ARGV.delete("--count").nil?
+  {"--code" => [:code, 0..65535], "--facility" => [:facility, 0..15]}.each do |flag, (option, range)|
+    next unless index = ARGV.index(flag)
+    raise "provide the #{option} after #{flag} (#{range.first} to #{range.last})" unless ARGV[index+1] =~ /\A\d+\z/ and range.include?(ARGV[index+1].to_i)
+    options[option] = ARGV[index+1].to_i
+    ARGV.slice!(index, 2)
+  end
+  ["--from", "--to"].each do |flag|
+    next unless index = ARGV.index(flag)
+    raise "provide the time after #{flag}" unless ARGV[index+1]
+    options[flag[2..-1].to_sym] = parse_time(ARGV[index+1])
+    ARGV.slice!(index, 2)
+  end
+  raise "provide the event store directory (written by decode.rb -e)" unless ARGV.size==1
+  store = EventStore.new(ARGV[0])
+  start = Time.now
+  if options.empty? and !count then # summary
+    puts "# events: #{store.count}"
+    puts "# first: #{format_time(store.first)}" if store.first
+    puts "# last: #{format_time(store.last)}" if store.last
+    puts "# sources: #{store.sources.size}"
+    puts "# size: #{store.size} bytes"
+  elsif count then
+    puts "# events: #{store.count_of(**options)}"
+  else
+    events = 0
+    store.each(**options) do |time, value, source, snr|
+      events += 1
+      printf("%s - value: 0X%06x, code: %05d, facility: %d, button: %d", format_time(time), value, (value >> 3) & 65535, (value >> 19) & 15, value & 7)
+      printf(", snr: %.1fdB", snr) if snr
+      puts ", source: #{source}"
+    end
+    puts "# events: #{events}"
+  end
+  printf("# time: %.1fms\n", (Time.now-start)*1000)
+end